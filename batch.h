@@ -0,0 +1,442 @@
+/*
+ * 複数の画像のバッチ処理
+ *
+ *   1つのプロセスで複数の画像を処理する。画像ごとにプロセスを起動す
+ * る代わりに、スレッドプールのスレッドがそれぞれ次の画像を取り出して
+ * 処理し、結果画像の領域は画像ごとに確保し直さずに使い回す。画像ごと
+ * の確認用の表示は行わず、最後に処理時間とスループットを表示する。
+ *
+ *   sample --batch <入力> <出力> [<入力> <出力> ...]
+ *   sample --batch-dir <出力ディレクトリ> <入力> [<入力> ...]
+ *   sample --manifest <リストファイル>
+ *
+ * --batch-dir では、出力ファイル名を入力ファイル名(ディレクトリを除
+ * いたもの)と同じにする(シェルのワイルドカードと組み合わせて使う)。
+ * リストファイルには、1行に入力と出力のファイル名を空白で区切って書
+ * く。空行と '#' から行末までは読み飛ばす。名前から処理を選べるプロ
+ * グラム(sample_filter.c)では、行の先頭にフィルタの名前を書いて、画
+ * 像ごとに処理を変えられる。
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "thread_pool.h"
+
+/*
+ * 1枚の画像を処理する関数の型
+ *   originalImage を処理して resultImage にセットする。resultImage は
+ * originalImage と同じ画素数、階調数で用意してある。
+ */
+typedef void (*batch_process_t)(image_t *resultImage, image_t *originalImage);
+
+/*
+ * 名前から1枚の画像を処理する関数を求める関数の型
+ *   登録されていない名前の時は NULL を返す。
+ */
+typedef batch_process_t (*batch_lookup_t)(const char *name);
+
+/*
+ * 1枚の画像の処理の構造体の定義
+ */
+typedef struct
+{
+    char *input;             /* 入力ファイル名 */
+    char *output;            /* 出力ファイル名 */
+    batch_process_t process; /* 1枚の画像を処理する関数 */
+    int width;               /* 画像の横方向の画素数 */
+    int height;              /* 画像の縦方向の画素数 */
+    double seconds;          /* 処理時間(読み込みから書き込みまで) */
+    const char *error;       /* 失敗した理由(成功した時は NULL) */
+} batch_job_t;
+
+/*
+ * バッチ処理の構造体の定義
+ */
+typedef struct
+{
+    batch_job_t *jobs;       /* 処理する画像 */
+    int count;               /* 画像の数 */
+    int capacity;            /* jobs の領域の要素数 */
+    int next;                /* 次に処理する画像 */
+    batch_process_t process; /* 処理の指定がない画像を処理する関数 */
+    batch_lookup_t lookup;   /* 名前から処理を求める関数(NULL の時は */
+                             /* 名前を指定できない) */
+} batch_t;
+
+/*======================================================================
+ * バッチ処理の引数かどうかの判定
+ *======================================================================
+ */
+int isBatchArg(int argc, char **argv)
+{
+    return argc >= 2 &&
+           (strcmp(argv[1], "--batch") == 0 || strcmp(argv[1], "--batch-dir") == 0 ||
+            strcmp(argv[1], "--manifest") == 0);
+}
+
+/*======================================================================
+ * 文字列の複製
+ *======================================================================
+ */
+static char *copyBatchString(const char *s, size_t length)
+{
+    char *copy = (char *)malloc(length + 1);
+
+    if (copy == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    memcpy(copy, s, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+/*======================================================================
+ * 処理する画像の追加
+ *======================================================================
+ */
+void addBatchJob(batch_t *batch, batch_process_t process, const char *input, const char *output)
+{
+    if (batch->count == batch->capacity)
+    {
+        batch->capacity = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        batch->jobs = (batch_job_t *)realloc(batch->jobs, sizeof(batch_job_t) * batch->capacity);
+        if (batch->jobs == NULL)
+        {
+            fputs("out of memory\n", stderr);
+            exit(1);
+        }
+    }
+
+    batch_job_t *job = &batch->jobs[batch->count++];
+    job->input = copyBatchString(input, strlen(input));
+    job->output = copyBatchString(output, strlen(output));
+    job->process = process;
+    job->width = 0;
+    job->height = 0;
+    job->seconds = 0;
+    job->error = NULL;
+
+    return;
+}
+
+/*======================================================================
+ * リストファイルの読み込み
+ *======================================================================
+ *   リストファイル const char *path から、入力と出力のファイル名の組
+ * を読み込んで batch_t *batch に追加する。batch->lookup がある時は、
+ * 行の先頭に処理の名前を書ける。
+ */
+void readBatchManifest(batch_t *batch, const char *path)
+{
+    char line[4096];
+    int lineNumber = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        fputs("Opening the manifest file was failed\n", stderr);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *names[3];
+        size_t lengths[3];
+        int n = 0;
+        char *p = line;
+
+        lineNumber++;
+
+        /* 空白で区切られたファイル名('#' 以降は注釈) */
+        for (;;)
+        {
+            while (isPgmSpace(*p))
+            {
+                p++;
+            }
+            if (*p == '\0' || *p == '#')
+            {
+                break;
+            }
+            if (n == 3)
+            {
+                goto error;
+            }
+            names[n] = p;
+            while (*p != '\0' && *p != '#' && !isPgmSpace(*p))
+            {
+                p++;
+            }
+            lengths[n] = (size_t)(p - names[n]);
+            n++;
+        }
+
+        if (n == 0)
+        {
+            continue;
+        }
+        if (n == 1 || (n == 3 && batch->lookup == NULL))
+        {
+            goto error;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            names[i][lengths[i]] = '\0';
+        }
+
+        /* 処理の指定 */
+        batch_process_t process = batch->process;
+        if (n == 3)
+        {
+            process = batch->lookup(names[0]);
+            if (process == NULL)
+            {
+                fprintf(stderr, "%s:%d: unknown filter '%s'\n", path, lineNumber, names[0]);
+                exit(1);
+            }
+        }
+        if (process == NULL)
+        {
+            fprintf(stderr, "%s:%d: the filter must be specified\n", path, lineNumber);
+            exit(1);
+        }
+
+        addBatchJob(batch, process, names[n - 2], names[n - 1]);
+    }
+
+    fclose(fp);
+
+    return;
+
+error:
+    fprintf(stderr, "%s:%d: the line must be %s<input pgm file> <output pgm file>\n", path, lineNumber,
+            batch->lookup != NULL ? "[<filter>] " : "");
+    exit(1);
+}
+
+/*======================================================================
+ * バッチ処理の引数の解析
+ *======================================================================
+ */
+void parseBatchArg(int argc, char **argv, batch_t *batch)
+{
+    /* --batch と --batch-dir はすべての画像を同じ処理で行う */
+    if (strcmp(argv[1], "--manifest") != 0 && batch->process == NULL)
+    {
+        goto usage;
+    }
+
+    if (strcmp(argv[1], "--batch") == 0)
+    {
+        if (argc < 4 || (argc - 2) % 2 != 0)
+        {
+            goto usage;
+        }
+        for (int i = 2; i < argc; i += 2)
+        {
+            addBatchJob(batch, batch->process, argv[i], argv[i + 1]);
+        }
+    }
+    else if (strcmp(argv[1], "--batch-dir") == 0)
+    {
+        if (argc < 4)
+        {
+            goto usage;
+        }
+        for (int i = 3; i < argc; i++)
+        {
+            const char *name = argv[i];
+            size_t dirLength = strlen(argv[2]);
+
+            /* ディレクトリを除いた入力ファイル名 */
+            for (const char *p = argv[i]; *p != '\0'; p++)
+            {
+                if (*p == '/' || *p == '\\')
+                {
+                    name = p + 1;
+                }
+            }
+
+            char *output = (char *)malloc(dirLength + strlen(name) + 2);
+            if (output == NULL)
+            {
+                fputs("out of memory\n", stderr);
+                exit(1);
+            }
+            sprintf(output, "%s/%s", argv[2], name);
+            addBatchJob(batch, batch->process, argv[i], output);
+            free(output);
+        }
+    }
+    else
+    {
+        if (argc != 3)
+        {
+            goto usage;
+        }
+        readBatchManifest(batch, argv[2]);
+    }
+
+    return;
+
+/* このプログラムの使い方の説明 */
+usage:
+    fprintf(stderr, "usage : %s --batch <input pgm file> <output pgm file> ...\n", argv[0]);
+    fprintf(stderr, "        %s --batch-dir <output directory> <input pgm file> ...\n", argv[0]);
+    fprintf(stderr, "        %s --manifest <manifest file>\n", argv[0]);
+    exit(1);
+}
+
+/*======================================================================
+ * バッチ処理のスレッドの処理
+ *======================================================================
+ *   まだ処理されていない画像を1枚ずつ取り出して、読み込み、処理、書き
+ * 込みを行う。結果画像の領域はスレッドごとに使い回す。
+ *   開けない、または読み込めない画像は、理由を job->error に入れて飛
+ * ばし、出力ファイルは作らない(プロセスを終了せずに次の画像に進む)。
+ */
+static void batchWorker(void *arg, int band, int begin, int end)
+{
+    batch_t *batch = (batch_t *)arg;
+    image_t originalImage, resultImage;
+
+    (void)band;
+    (void)begin;
+    (void)end;
+
+    resultImage.data = NULL;
+    resultImage.mapAddress = NULL;
+    resultImage.mapLength = 0;
+    resultImage.capacity = 0;
+
+    for (;;)
+    {
+        int i = __sync_fetch_and_add(&batch->next, 1);
+        if (i >= batch->count)
+        {
+            break;
+        }
+
+        batch_job_t *job = &batch->jobs[i];
+        double start = getTime();
+
+        FILE *infp = fopen(job->input, "rb");
+        if (infp == NULL)
+        {
+            job->error = "failed to open input";
+            continue;
+        }
+
+        /* 出力ファイルは、入力を読み込めてから作る */
+        const char *message;
+        if (tryReadPgmRawHeader(infp, &originalImage, &message) != 0 ||
+            tryReadPgmRawBitmapData(infp, &originalImage, &message) != 0)
+        {
+            fclose(infp);
+            freeImage(&originalImage);
+            job->error = message;
+            continue;
+        }
+        fclose(infp);
+
+        FILE *outfp = fopen(job->output, "wb");
+        if (outfp == NULL)
+        {
+            freeImage(&originalImage);
+            job->error = "failed to open output";
+            continue;
+        }
+
+        reuseImage(&resultImage, originalImage.width, originalImage.height, originalImage.maxValue);
+        job->process(&resultImage, &originalImage);
+
+        writePgmRawHeader(outfp, &resultImage);
+        writePgmRawBitmapData(outfp, &resultImage);
+        if (fclose(outfp) != 0)
+        {
+            fputs("Writing PGM-RAW bitmap data was failed\n", stderr);
+            exit(1);
+        }
+
+        job->width = originalImage.width;
+        job->height = originalImage.height;
+        job->seconds = getTime() - start;
+        freeImage(&originalImage);
+    }
+
+    freeImage(&resultImage);
+
+    return;
+}
+
+/*======================================================================
+ * バッチ処理
+ *======================================================================
+ *   引数で指定された画像を、1枚ずつ process で処理する。lookup がある
+ * 時は、リストファイルの行ごとに名前で処理を選べる(process が NULL
+ * の時は、すべての行で名前を指定する)。画像はスレッドプールのスレッ
+ * ドで並列に処理し、1枚の画像の中の処理は並列化しない。最後に画像ご
+ * とと全体の処理時間、スループットを表示する。
+ *   開けなかった、または読み込めなかったファイルがあれば 1 を、なけれ
+ * ば 0 を返す。
+ */
+int runBatch(int argc, char **argv, batch_process_t process, batch_lookup_t lookup)
+{
+    batch_t batch = {NULL, 0, 0, 0, process, lookup};
+    int failed = 0;
+    double pixels = 0;
+
+    parseBatchArg(argc, argv, &batch);
+
+    /* 画像ごとの確認用の表示はしない */
+    showDiagnostics = 0;
+
+    double start = getTime();
+    int workers = parallelFor(getThreadCount() < batch.count ? getThreadCount() : batch.count,
+                              batchWorker, &batch);
+    double seconds = getTime() - start;
+
+    /* 画像ごとの処理時間 */
+    for (int i = 0; i < batch.count; i++)
+    {
+        batch_job_t *job = &batch.jobs[i];
+
+        if (job->error != NULL)
+        {
+            printf("batch: [%d/%d] %s -> %s, %s\n", i + 1, batch.count, job->input, job->output, job->error);
+            failed++;
+            continue;
+        }
+
+        double mpix = (double)job->width * (double)job->height * 1e-6;
+        pixels += mpix;
+        printf("batch: [%d/%d] %s -> %s, %dx%d, %.3f ms, %.1f Mpix/s\n", i + 1, batch.count,
+               job->input, job->output, job->width, job->height, job->seconds * 1000.0,
+               job->seconds > 0 ? mpix / job->seconds : 0.0);
+    }
+
+    /* 全体の処理時間 */
+    printf("batch: images=%d, failed=%d, workers=%d, time=%.3f s, %.1f images/s, %.1f Mpix/s\n",
+           batch.count - failed, failed, workers, seconds,
+           seconds > 0 ? (batch.count - failed) / seconds : 0.0, seconds > 0 ? pixels / seconds : 0.0);
+
+    for (int i = 0; i < batch.count; i++)
+    {
+        free(batch.jobs[i].input);
+        free(batch.jobs[i].output);
+    }
+    free(batch.jobs);
+
+    return failed > 0 ? 1 : 0;
+}
+
+#endif /* BATCH_H */
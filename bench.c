@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pgm.h"
+#include "filter.h"
+#include "stencil.h"
+#include "batch.h"
+#include "registry.h"
+#include "synth.h"
+
+/*
+ * 出力形式
+ */
+#define BENCH_FORMAT_CSV 0
+#define BENCH_FORMAT_JSON 1
+
+/*
+ * ベンチマークの設定
+ */
+typedef struct
+{
+    int width;          /* 合成画像の横方向の画素数 */
+    int height;         /* 合成画像の縦方向の画素数 */
+    int pattern;        /* 合成画像の種類(-1 はすべて) */
+    const char *filter; /* フィルタの名前(NULL はすべて) */
+    int repeat;         /* 計測する回数 */
+    int warmup;         /* 計測しない最初の回数 */
+    int format;         /* 出力形式 */
+    unsigned seed;      /* 合成画像の乱数の種 */
+} bench_config_t;
+
+/*======================================================================
+ * このプログラムの使い方の説明
+ *======================================================================
+ */
+void usage(char *program)
+{
+    fprintf(stderr, "usage : %s [options]\n", program);
+    fprintf(stderr, "        %s --generate <pattern> <width> <height> <output pgm file>\n", program);
+    fprintf(stderr, "options: --size <width>x<height>  (default 1920x1080)\n");
+    fprintf(stderr, "         --pattern <pattern>|all  (default all)\n");
+    fprintf(stderr, "         --filter <filter>|all    (default all)\n");
+    fprintf(stderr, "         --repeat <n>             (default 20)\n");
+    fprintf(stderr, "         --warmup <n>             (default 3)\n");
+    fprintf(stderr, "         --seed <n>               (default 1)\n");
+    fprintf(stderr, "         --format csv|json        (default csv)\n");
+    fprintf(stderr, "pattern: noise, gradient, texture, constant\n");
+    fprintf(stderr, "filter: ");
+    printFilterNames(stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * double の比較(qsort 用)
+ *======================================================================
+ */
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*======================================================================
+ * 1つのフィルタと合成画像の計測
+ *======================================================================
+ *   warmup 回処理した後、repeat 回の処理時間を計り、中央値、95 パーセ
+ * ンタイル(nearest rank)、最小値と、中央値から求めた Mpix/s、GB/s を
+ * 1行出力する。GB/s は、入力画像の読み込みと結果画像の書き込み
+ * (1画素2バイト)を処理時間で割ったもの。結果を比べられるように、処
+ * 理の設定(命令セット、スレッド数と、環境変数 FILTER_FUSED、
+ * FILTER_BORDER、FILTER_MAGNITUDE の値)も出力する。
+ */
+void benchFilter(const filter_entry_t *filter, int pattern, image_t *originalImage,
+                 image_t *resultImage, const bench_config_t *config)
+{
+    double *times = (double *)malloc(sizeof(double) * config->repeat);
+    if (times == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    for (int i = 0; i < config->warmup; i++)
+    {
+        filter->process(resultImage, originalImage);
+    }
+    for (int i = 0; i < config->repeat; i++)
+    {
+        double start = getTime();
+        filter->process(resultImage, originalImage);
+        times[i] = getTime() - start;
+    }
+
+    qsort(times, config->repeat, sizeof(double), compareDouble);
+
+    int n = config->repeat;
+    double median = n % 2 == 1 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2.0;
+    int rank = (int)ceil(0.95 * n) - 1;
+    double p95 = times[rank < 0 ? 0 : rank];
+    double minimum = times[0];
+
+    double pixels = (double)originalImage->width * (double)originalImage->height;
+    double mpixPerSecond = median > 0.0 ? pixels / median * 1e-6 : 0.0;
+    double gbPerSecond = median > 0.0 ? pixels * 2.0 / median * 1e-9 : 0.0;
+
+    if (config->format == BENCH_FORMAT_JSON)
+    {
+        printf("{\"filter\":\"%s\",\"pattern\":\"%s\",\"width\":%d,\"height\":%d,"
+               "\"isa\":\"%s\",\"threads\":%d,\"fused\":%d,\"border\":\"%s\",\"magnitude\":\"%s\","
+               "\"repeat\":%d,\"warmup\":%d,"
+               "\"median_ms\":%.3f,\"p95_ms\":%.3f,\"min_ms\":%.3f,"
+               "\"mpix_per_s\":%.1f,\"gb_per_s\":%.3f}\n",
+               filter->name, patternNames[pattern], originalImage->width, originalImage->height,
+               stencilIsaNames[getStencilIsa()], getThreadCount(), getFusedMode(),
+               borderNames[getBorderMode()], magnitudeNames[getMagnitudeMode()], config->repeat, config->warmup,
+               median * 1000.0, p95 * 1000.0, minimum * 1000.0, mpixPerSecond, gbPerSecond);
+    }
+    else
+    {
+        printf("%s,%s,%d,%d,%s,%d,%d,%s,%s,%d,%d,%.3f,%.3f,%.3f,%.1f,%.3f\n",
+               filter->name, patternNames[pattern], originalImage->width, originalImage->height,
+               stencilIsaNames[getStencilIsa()], getThreadCount(), getFusedMode(),
+               borderNames[getBorderMode()], magnitudeNames[getMagnitudeMode()], config->repeat, config->warmup,
+               median * 1000.0, p95 * 1000.0, minimum * 1000.0, mpixPerSecond, gbPerSecond);
+    }
+    fflush(stdout);
+
+    free(times);
+
+    return;
+}
+
+/*======================================================================
+ * 引数の数値の解析
+ *======================================================================
+ *   min 以上の整数でなければ -1 を返す。
+ */
+static int parseBenchInt(const char *s, int min)
+{
+    char *end;
+    long value = strtol(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0' || value < min || value > 1000000000L)
+    {
+        return -1;
+    }
+
+    return (int)value;
+}
+
+/*======================================================================
+ * 合成画像の書き出し
+ *======================================================================
+ *   bench --generate <種類> <幅> <高さ> <出力>
+ *   他のプログラムの入力に使えるように、合成画像を PGM-RAW で書き込む。
+ */
+int generateMain(int argc, char **argv)
+{
+    image_t image;
+
+    if (argc != 6)
+    {
+        usage(argv[0]);
+    }
+
+    int pattern = findPattern(argv[2]);
+    int width = parseBenchInt(argv[3], 1);
+    int height = parseBenchInt(argv[4], 1);
+    if (pattern < 0 || width < 0 || height < 0)
+    {
+        usage(argv[0]);
+    }
+
+    FILE *outfp = fopen(argv[5], "wb");
+    if (outfp == NULL)
+    {
+        fputs("Opening the output file was failend\n", stderr);
+        usage(argv[0]);
+    }
+
+    generateImage(&image, pattern, width, height, 255, 1);
+    writePgmRawHeader(outfp, &image);
+    writePgmRawBitmapData(outfp, &image);
+    if (fclose(outfp) != 0)
+    {
+        fputs("Writing PGM-RAW bitmap data was failed\n", stderr);
+        exit(1);
+    }
+    freeImage(&image);
+
+    return 0;
+}
+
+/*
+ * メイン
+ *   合成画像を作り、登録されているすべてのフィルタ(sample_1_*.c、
+ * sample_2.c と同じ処理)の処理時間を計って、1行に1つの結果を CSV ま
+ * たは JSON で出力する。読み書きは含まない。環境変数 FILTER_ISA、
+ * FILTER_THREADS などは通常どおりに効く。
+ */
+int main(int argc, char **argv)
+{
+    bench_config_t config = {1920, 1080, -1, NULL, 20, 3, BENCH_FORMAT_CSV, 1};
+
+    /* 合成画像の書き出し */
+    if (argc >= 2 && strcmp(argv[1], "--generate") == 0)
+    {
+        return generateMain(argc, argv);
+    }
+
+    /* 引数の解析 */
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+        }
+
+        const char *value = argv[++i];
+        if (strcmp(argv[i - 1], "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &config.width, &config.height) != 2 ||
+                config.width < 1 || config.height < 1)
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i - 1], "--pattern") == 0)
+        {
+            config.pattern = findPattern(value);
+            if (config.pattern < -1)
+            {
+                fprintf(stderr, "unknown pattern '%s'\n", value);
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i - 1], "--filter") == 0)
+        {
+            config.filter = strcmp(value, "all") == 0 ? NULL : value;
+            if (config.filter != NULL && findFilter(config.filter) == NULL)
+            {
+                fprintf(stderr, "unknown filter '%s'\n", value);
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i - 1], "--repeat") == 0)
+        {
+            if ((config.repeat = parseBenchInt(value, 1)) < 0)
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i - 1], "--warmup") == 0)
+        {
+            if ((config.warmup = parseBenchInt(value, 0)) < 0)
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i - 1], "--seed") == 0)
+        {
+            int seed = parseBenchInt(value, 0);
+            if (seed < 0)
+            {
+                usage(argv[0]);
+            }
+            config.seed = (unsigned)seed;
+        }
+        else if (strcmp(argv[i - 1], "--format") == 0)
+        {
+            if (strcmp(value, "csv") == 0)
+            {
+                config.format = BENCH_FORMAT_CSV;
+            }
+            else if (strcmp(value, "json") == 0)
+            {
+                config.format = BENCH_FORMAT_JSON;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    /* 画像ごとの確認用の表示はしない */
+    showDiagnostics = 0;
+
+    if (config.format == BENCH_FORMAT_CSV)
+    {
+        printf("filter,pattern,width,height,isa,threads,fused,border,magnitude,repeat,warmup,"
+               "median_ms,p95_ms,min_ms,mpix_per_s,gb_per_s\n");
+    }
+
+    image_t originalImage, resultImage;
+    initImage(&resultImage, config.width, config.height, 255);
+
+    for (int pattern = 0; pattern < PATTERN_COUNT; pattern++)
+    {
+        if (config.pattern >= 0 && pattern != config.pattern)
+        {
+            continue;
+        }
+
+        generateImage(&originalImage, pattern, config.width, config.height, 255, config.seed);
+
+        for (int i = 0; i < FILTER_COUNT; i++)
+        {
+            if (config.filter != NULL && strcmp(config.filter, filterEntries[i].name) != 0)
+            {
+                continue;
+            }
+            benchFilter(&filterEntries[i], pattern, &originalImage, &resultImage, &config);
+        }
+
+        freeImage(&originalImage);
+    }
+
+    freeImage(&resultImage);
+
+    return 0;
+}
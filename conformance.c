@@ -0,0 +1,1087 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "pgm.h"
+#include "filter.h"
+#include "stencil.h"
+#include "stream.h"
+#include "multi.h"
+#include "kernel.h"
+#include "otsu.h"
+#include "registry.h"
+#include "synth.h"
+
+/*
+ * マクロ定義
+ */
+#define min(A, B) ((A) < (B) ? (A) : (B))
+#define max(A, B) ((A) > (B) ? (A) : (B))
+
+/*
+ * 適合性の確認
+ *
+ *   最適化したフィルタ(SIMD、スレッド、2回計算、ストリーミング、複数
+ * 同時、カーネルの解析)の結果が、元の sample_1_*.c、sample_2.c の処
+ * 理(スカラーの実装)と1バイトも違わないことを、合成画像の集まりで確
+ * かめる。元の処理は、以下の oracle* 関数に、そのままの形で残しておく
+ * (最適化の対象の関数を呼ぶと、比べる意味がなくなるので)。
+ */
+
+/*
+ * 合成画像の集まりに加える画像の種類(synth.h の種類の続き)
+ */
+#define CORPUS_CHECKER (PATTERN_COUNT + 0) /* 0 と maxValue の市松模様 */
+#define CORPUS_SPIKES (PATTERN_COUNT + 1)  /* 0 の中にまばらな maxValue */
+#define CORPUS_BLACK (PATTERN_COUNT + 2)   /* すべて 0 */
+#define CORPUS_WHITE (PATTERN_COUNT + 3)   /* すべて maxValue */
+#define CORPUS_LEVELS (PATTERN_COUNT + 4)  /* 等間隔の3つの画素値が同じ画素数ずつ */
+#define CORPUS_MIRROR (PATTERN_COUNT + 5)  /* 中央の値に対して対称な画素値の組 */
+#define CORPUS_PATTERN_COUNT (PATTERN_COUNT + 6)
+#define CORPUS_FIXTURE CORPUS_PATTERN_COUNT /* 画素値を並べた画像(otsuFixtures) */
+
+static const char *corpusPatternNames[] = {"checker", "spikes", "black", "white", "levels", "mirror", "fixture"};
+
+/*
+ * 合成画像の大きさ(幅 1 や高さ 1、奇数の幅、SIMD の幅の前後を含む)
+ */
+static const int corpusSizes[][2] = {
+    {1, 1}, {1, 2}, {2, 1}, {1, 9}, {9, 1}, {2, 2}, {3, 3}, {4, 5}, {7, 3},
+    {17, 5}, {31, 33}, {33, 31}, {63, 2}, {64, 64}, {65, 17}, {129, 7}, {257, 130}};
+#define CORPUS_SIZE_COUNT ((int)(sizeof(corpusSizes) / sizeof(corpusSizes[0])))
+
+/*
+ * 大津の方法でクラス間分散が同じになる閾値の候補が複数ある画素値の並
+ * び(-1 で終わり)。元の処理は float の丸めで候補を選ぶので、最初の候
+ * 補が選ばれるとは限らない(順に 102、115、218 が選ばれる)。
+ */
+static const int otsuFixtures[][10] = {
+    {89, 89, 89, 102, 102, 102, 115, 115, 115, -1},
+    {97, 97, 97, 115, 133, 133, 133, -1},
+    {199, 199, 203, 203, 218, 233, 233, 237, 237, -1}};
+#define OTSU_FIXTURE_COUNT ((int)(sizeof(otsuFixtures) / sizeof(otsuFixtures[0])))
+
+/*
+ * 合成画像の階調数
+ */
+static const int corpusMaxValues[] = {255, 254, 100, 1};
+#define CORPUS_MAX_VALUE_COUNT ((int)(sizeof(corpusMaxValues) / sizeof(corpusMaxValues[0])))
+
+/*
+ * 1枚の合成画像と、その PGM-RAW のバイト列
+ */
+typedef struct
+{
+    image_t image;      /* 合成画像(各行の先頭を境界に合わせたもの) */
+    image_t dense;      /* 同じ画像の、行の間を詰めたもの(元の処理に渡す) */
+    int pattern;        /* 種類 */
+    unsigned char *pgm; /* PGM-RAW のバイト列 */
+    size_t pgmLength;   /* PGM-RAW のバイト数 */
+} corpus_image_t;
+
+/*
+ * 確認の件数
+ */
+static int checkCount = 0;
+static int failedCount = 0;
+
+/*
+ * 表示する不一致の最大数
+ */
+#define MAX_REPORTED_FAILURES 20
+
+/*======================================================================
+ * このプログラムの使い方の説明
+ *======================================================================
+ */
+void usage(char *program)
+{
+    fprintf(stderr, "usage : %s            (every isa and thread count)\n", program);
+    fprintf(stderr, "        %s --single   (the current FILTER_ISA and FILTER_THREADS only)\n", program);
+    exit(1);
+}
+
+/*======================================================================
+ * 元の処理の画像構造体の初期化
+ *======================================================================
+ *   元の処理は画素値データの行の間が詰まっている(stride が width と
+ * 同じ)ものとして添字を計算するので、そのような画像を作る。
+ */
+void initOracleImage(image_t *ptImage, int width, int height, int maxValue)
+{
+    initImage(ptImage, width, height, maxValue);
+    ptImage->stride = width;
+
+    return;
+}
+
+/*======================================================================
+ * 元の処理: PGM-RAW フォーマットのバイト列
+ *======================================================================
+ *   writePgmRawHeader()、writePgmRawBitmapData() が書き込むものと同じ
+ * バイト列を、画像構造体 image_t *ptImage から作る。
+ */
+unsigned char *oraclePgm(image_t *ptImage, size_t *length)
+{
+    char header[64];
+    int headerLength = snprintf(header, sizeof(header), "P5\n%d %d\n%d\n",
+                                ptImage->width, ptImage->height, ptImage->maxValue);
+    size_t size = (size_t)ptImage->width * (size_t)ptImage->height;
+
+    unsigned char *pgm = (unsigned char *)malloc(headerLength + size);
+    if (pgm == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    memcpy(pgm, header, headerLength);
+    for (int y = 0; y < ptImage->height; y++)
+    {
+        memcpy(pgm + headerLength + (size_t)ptImage->width * y, ptImage->data + (size_t)ptImage->stride * y,
+               ptImage->width);
+    }
+    *length = headerLength + size;
+
+    return pgm;
+}
+
+/*======================================================================
+ * 元の処理: パディングを加えた画像の初期化
+ *======================================================================
+ */
+void oraclePaddingImage(image_t *originalImage, padding_image_t *paddingImage, int kernel_width, int kernel_height)
+{
+    int original_image_width = originalImage->width;
+
+    /* パディングの大きさ */
+    int padding_x = (kernel_width - 1) / 2;
+    int padding_y = (kernel_height - 1) / 2;
+
+    /* パディングを加えた画像のサイズ */
+    int padding_image_width = original_image_width + padding_x * 2;
+    int padding_image_height = originalImage->height + padding_y * 2;
+
+    paddingImage->width = padding_image_width;
+    paddingImage->height = padding_image_height;
+    paddingImage->maxValue = originalImage->maxValue;
+    paddingImage->padding_x = padding_x;
+    paddingImage->padding_y = padding_y;
+    paddingImage->stride = padding_image_width;
+    paddingImage->data = (unsigned char *)malloc(sizeof(unsigned char) * (padding_image_width * padding_image_height));
+    if (paddingImage->data == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    /* データのセット */
+    for (int y = 0; y < padding_image_height; y++)
+    {
+        for (int x = 0; x < padding_image_width; x++)
+        {
+            if (x < padding_x || x >= padding_image_width - padding_x || y < padding_y || y >= padding_image_height - padding_y)
+            {
+                /* ゼロパディング */
+                paddingImage->data[x + padding_image_width * y] = 0;
+            }
+            else
+            {
+                paddingImage->data[x + padding_image_width * y] = originalImage->data[(x - padding_x) + original_image_width * (y - padding_y)];
+            }
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 元の処理: 畳み込み演算
+ *======================================================================
+ */
+int oracleConvolution(int x, int y, padding_image_t *paddingImage, kernel_t *kernel)
+{
+    int sum = 0;
+    int kernel_width = kernel->width;
+    int kernel_height = kernel->height;
+    int half_kernel_width = (kernel_width - 1) / 2;
+    int half_kernel_height = (kernel_height - 1) / 2;
+
+    for (int j = 0; j < kernel_height; j++)
+    {
+        for (int i = 0; i < kernel_width; i++)
+        {
+            int paddingImage_pixel = paddingImage->data[(x + (i - half_kernel_width)) + paddingImage->width * (y + (j - half_kernel_height))];
+            int kernel_pixel = kernel->data[i + kernel_width * j];
+            sum += paddingImage_pixel * kernel_pixel;
+        }
+    }
+
+    return sum;
+}
+
+/*======================================================================
+ * 元の処理: [0, 255]に正規化した画像データのセット
+ *======================================================================
+ *   min == max の時、元の式は 0 除算(C では未定義)になり、x86 では
+ * 結果が 0 になっていたので、そのまま 0 とする。
+ */
+void oracleNormalize(int *tmp, int minValue, int maxValue, image_t *resultImage)
+{
+    int N = resultImage->width * resultImage->height;
+
+    for (int i = 0; i < N; i++)
+    {
+        int result_image_pixel = 0;
+        if (maxValue != minValue)
+        {
+            /* x'=255*(x-min)/(max-min) (x'の範囲[0, 255]) */
+            result_image_pixel = (int)(((double)(tmp[i] - minValue) / (double)(maxValue - minValue)) * (double)resultImage->maxValue);
+        }
+        resultImage->data[i] = result_image_pixel;
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 元の処理: 3x3 のフィルタ
+ *======================================================================
+ *   sample_1_1.c から sample_1_6.c までの filteringImage() と同じ計算
+ * を stencil の種類について行う。近似の種類(*_AMBM)は、同じ畳み込み
+ * の値から max + 3/8 min を求める。
+ */
+void oracleStencil(image_t *resultImage, image_t *originalImage, int stencil)
+{
+    static const int prewittX[] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
+    static const int prewittY[] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
+    static const int sobelX[] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    static const int sobelY[] = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+    static const int laplacian4[] = {0, 1, 0, 1, -4, 1, 0, 1, 0};
+    static const int laplacian8[] = {1, 1, 1, 1, -8, 1, 1, 1, 1};
+
+    int sobel = stencil == STENCIL_SOBEL_L2 || stencil == STENCIL_SOBEL_L1 || stencil == STENCIL_SOBEL_AMBM;
+    int laplacian = stencil == STENCIL_LAPLACIAN4 || stencil == STENCIL_LAPLACIAN8;
+    int kernel_x_data[9], kernel_y_data[9];
+    kernel_t kernel_x = {3, 3, kernel_x_data};
+    kernel_t kernel_y = {3, 3, kernel_y_data};
+
+    memcpy(kernel_x_data, laplacian ? (stencil == STENCIL_LAPLACIAN4 ? laplacian4 : laplacian8) : (sobel ? sobelX : prewittX), sizeof(kernel_x_data));
+    memcpy(kernel_y_data, sobel ? sobelY : prewittY, sizeof(kernel_y_data));
+
+    padding_image_t paddingImage;
+    oraclePaddingImage(originalImage, &paddingImage, 3, 3);
+
+    int original_image_width = originalImage->width;
+    int original_image_height = originalImage->height;
+    int *tmp = (int *)malloc(sizeof(int) * original_image_width * original_image_height);
+    if (tmp == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    int tmp_image_minValue = 255;
+    int tmp_image_maxValue = 0;
+
+    /* フィルタリング */
+    for (int y = 1; y < original_image_height + 1; y++)
+    {
+        for (int x = 1; x < original_image_width + 1; x++)
+        {
+            int i = (x - 1) + original_image_width * (y - 1);
+
+            if (laplacian)
+            {
+                int g = oracleConvolution(x, y, &paddingImage, &kernel_x);
+
+                // 範囲外の値は0or255にする
+                resultImage->data[i] = min(255, max(0, g));
+                continue;
+            }
+
+            /* 畳み込み演算 */
+            int dfdx = oracleConvolution(x, y, &paddingImage, &kernel_x);
+            int dfdy = oracleConvolution(x, y, &paddingImage, &kernel_y);
+            int g;
+
+            if (stencil == STENCIL_PREWITT_L2 || stencil == STENCIL_SOBEL_L2)
+            {
+                g = (unsigned int)sqrt(dfdx * dfdx + dfdy * dfdy);
+            }
+            else if (stencil == STENCIL_PREWITT_L1 || stencil == STENCIL_SOBEL_L1)
+            {
+                g = abs(dfdx) + abs(dfdy);
+            }
+            else
+            {
+                int mx = max(abs(dfdx), abs(dfdy));
+                int mn = min(abs(dfdx), abs(dfdy));
+                g = mx + ((3 * mn) >> 3);
+            }
+            tmp[i] = g;
+
+            /* 最小値の更新 */
+            if (tmp_image_minValue > g)
+            {
+                tmp_image_minValue = g;
+            }
+            /* 最大値の更新 */
+            if (tmp_image_maxValue < g)
+            {
+                tmp_image_maxValue = g;
+            }
+        }
+    }
+
+    if (!laplacian)
+    {
+        /* [0, 255]に正規化したものをresultImageにセット */
+        oracleNormalize(tmp, tmp_image_minValue, tmp_image_maxValue, resultImage);
+    }
+
+    free(tmp);
+    free(paddingImage.data);
+
+    return;
+}
+
+/*======================================================================
+ * 元の処理: 閾値を求める
+ *======================================================================
+ */
+int oracleThreshold(image_t *originalImage)
+{
+    int T = 0;
+    float max_sigma = 0;
+    int N = originalImage->width * originalImage->height;
+    int ni[256] = {0};
+    float pi[256] = {0};
+
+    // 確率の計算
+    for (int i = 0; i < 256; i++)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            if (originalImage->data[j] == i)
+            {
+                ni[i]++;
+            }
+        }
+        // 確率
+        pi[i] = (float)ni[i] / (float)N;
+    }
+
+    // しきい値の計算
+    for (int k = 0; k < 256; k++)
+    {
+        float omega0 = 0;
+        float omega1 = 0;
+        // omega0, omega1の計算
+        for (int i = 0; i < 256; i++)
+        {
+            if (i <= k)
+            {
+                omega0 += pi[i];
+            }
+            else
+            {
+                omega1 += pi[i];
+            }
+        }
+
+        // 分散
+        float mu0 = 0;
+        float mu1 = 0;
+        float mut = 0;
+        // mu0, mu1, mutの計算
+        for (int i = 0; i < 256; i++)
+        {
+            float value = (float)i * pi[i];
+            mut += value;
+            if (i <= k)
+            {
+                mu0 += value;
+            }
+            else
+            {
+                mu1 += value;
+            }
+        }
+        mu0 /= omega0;
+        mu1 /= omega1;
+
+        // 分散
+        float sigma = omega0 * pow(mu0 - mut, 2) + omega1 * pow(mu1 - mut, 2);
+        if (sigma > max_sigma)
+        {
+            max_sigma = sigma;
+            T = k;
+        }
+    }
+
+    return T;
+}
+
+/*======================================================================
+ * 元の処理: 2値化
+ *======================================================================
+ */
+void oracleBinarization(image_t *resultImage, image_t *originalImage)
+{
+    int threshold = oracleThreshold(originalImage);
+    int N = originalImage->width * originalImage->height;
+
+    // 2値化
+    for (int i = 0; i < N; i++)
+    {
+        if (originalImage->data[i] <= threshold)
+        {
+            resultImage->data[i] = 0;
+        }
+        else
+        {
+            resultImage->data[i] = 255;
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 合成画像の作成
+ *======================================================================
+ *   synth.h の種類に加えて、市松模様、まばらな点、0 だけ、maxValue だ
+ * けの画像と、ヒストグラムが中央の値 maxValue / 2 に対して対称な画像
+ * を作る。対称な画像は、左上から i 番目と右下から i 番目の画素を中央
+ * の値から同じだけ上下に離した値にするので、大津の方法でクラス間分散
+ * が同じになる閾値の候補が複数できる。
+ */
+void makeCorpusImage(corpus_image_t *corpus, int pattern, int width, int height, int maxValue)
+{
+    image_t *image = &corpus->image;
+    int N = width * height;
+    int center = maxValue / 2;
+
+    corpus->pattern = pattern;
+    generateImage(image, pattern < PATTERN_COUNT ? pattern : PATTERN_CONSTANT, width, height, maxValue, 7);
+
+    for (int y = 0; y < height && pattern >= PATTERN_COUNT; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int value;
+            int i = x + width * y;
+            int j = min(i, N - 1 - i);
+            int sign = i < N - 1 - i ? -1 : i > N - 1 - i ? 1 : 0;
+
+            switch (pattern)
+            {
+            case CORPUS_LEVELS:
+                value = center + sign * (j * 3 < N ? maxValue / 4 : 0);
+                break;
+            case CORPUS_MIRROR:
+                value = center + sign * (synthHash(j, 0, 13) % 4) * (maxValue / 8);
+                break;
+            case CORPUS_CHECKER:
+                value = (x + y) % 2 == 0 ? 0 : maxValue;
+                break;
+            case CORPUS_SPIKES:
+                value = synthHash(x, y, 11) < 8 ? maxValue : 0;
+                break;
+            case CORPUS_BLACK:
+                value = 0;
+                break;
+            default:
+                value = maxValue;
+                break;
+            }
+            image->data[x + image->stride * y] = (unsigned char)value;
+        }
+    }
+
+    initOracleImage(&corpus->dense, width, height, maxValue);
+    copyImageData(&corpus->dense, image);
+    corpus->pgm = oraclePgm(&corpus->dense, &corpus->pgmLength);
+
+    return;
+}
+
+/*======================================================================
+ * 画素値を並べた画像の作成
+ *======================================================================
+ *   -1 で終わる画素値の並び values を1行に並べた、階調数 255 の画像を
+ * 作る。
+ */
+void makeFixtureImage(corpus_image_t *corpus, const int *values)
+{
+    int width = 0;
+
+    while (values[width] >= 0)
+    {
+        width++;
+    }
+
+    corpus->pattern = CORPUS_FIXTURE;
+    initImage(&corpus->image, width, 1, 255);
+    for (int x = 0; x < width; x++)
+    {
+        corpus->image.data[x] = (unsigned char)values[x];
+    }
+
+    initOracleImage(&corpus->dense, width, 1, 255);
+    copyImageData(&corpus->dense, &corpus->image);
+    corpus->pgm = oraclePgm(&corpus->dense, &corpus->pgmLength);
+
+    return;
+}
+
+/*======================================================================
+ * 合成画像の種類の名前
+ *======================================================================
+ */
+const char *corpusPatternName(int pattern)
+{
+    return pattern < PATTERN_COUNT ? patternNames[pattern] : corpusPatternNames[pattern - PATTERN_COUNT];
+}
+
+/*======================================================================
+ * ファイル全体の読み込み
+ *======================================================================
+ *   書き込みの終わった一時ファイル FILE *fp の内容を、先頭からすべて
+ * 読み込んで返す。
+ */
+unsigned char *readWholeFile(FILE *fp, size_t *length)
+{
+    fflush(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    unsigned char *buf = (unsigned char *)malloc(size > 0 ? (size_t)size : 1);
+    if (size < 0 || buf == NULL || fread(buf, 1, (size_t)size, fp) != (size_t)size)
+    {
+        fputs("Reading a temporary file was failed\n", stderr);
+        exit(1);
+    }
+    *length = (size_t)size;
+
+    return buf;
+}
+
+/*======================================================================
+ * PGM-RAW のバイト列を書いた一時ファイルの作成
+ *======================================================================
+ */
+FILE *openCorpusFile(corpus_image_t *corpus)
+{
+    FILE *fp = tmpfile();
+    if (fp == NULL || fwrite(corpus->pgm, 1, corpus->pgmLength, fp) != corpus->pgmLength)
+    {
+        fputs("Creating a temporary file was failed\n", stderr);
+        exit(1);
+    }
+    fflush(fp);
+    rewind(fp);
+
+    return fp;
+}
+
+/*======================================================================
+ * バイト列の比較
+ *======================================================================
+ *   元の処理の結果 expected と、最適化した処理の結果 actual が同じかど
+ * うかを確かめ、違う時は最初に違うバイトを表示する。
+ */
+void checkBytes(const char *path, const char *filter, corpus_image_t *corpus,
+                const unsigned char *expected, size_t expectedLength,
+                const unsigned char *actual, size_t actualLength)
+{
+    size_t i = 0;
+
+    checkCount++;
+    while (i < expectedLength && i < actualLength && expected[i] == actual[i])
+    {
+        i++;
+    }
+    if (i == expectedLength && i == actualLength)
+    {
+        return;
+    }
+
+    failedCount++;
+    if (failedCount <= MAX_REPORTED_FAILURES)
+    {
+        printf("conformance: FAIL %s %s %dx%d %s max=%d (isa=%s, threads=%d): ",
+               path, filter, corpus->image.width, corpus->image.height, corpusPatternName(corpus->pattern),
+               corpus->image.maxValue, stencilIsaNames[getStencilIsa()], getThreadCount());
+        if (i < expectedLength && i < actualLength)
+        {
+            printf("byte %zu is %d, expected %d\n", i, actual[i], expected[i]);
+        }
+        else
+        {
+            printf("length is %zu, expected %zu\n", actualLength, expectedLength);
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 画像を処理する関数の結果の確認
+ *======================================================================
+ *   PGM-RAW のバイト列を一時ファイルから readPgmRawHeader()、
+ * readPgmRawBitmapData() で読み込み、process で処理して、
+ * writePgmRawHeader()、writePgmRawBitmapData() で書き込んだものを、
+ * 元の処理の結果のバイト列と比べる。
+ */
+void checkProcess(const char *path, const char *filter, batch_process_t process,
+                  corpus_image_t *corpus, const unsigned char *expected, size_t expectedLength)
+{
+    image_t originalImage, resultImage;
+    FILE *infp = openCorpusFile(corpus);
+    FILE *outfp = tmpfile();
+    if (outfp == NULL)
+    {
+        fputs("Creating a temporary file was failed\n", stderr);
+        exit(1);
+    }
+
+    readPgmRawHeader(infp, &originalImage);
+    readPgmRawBitmapData(infp, &originalImage);
+    initImage(&resultImage, originalImage.width, originalImage.height, originalImage.maxValue);
+
+    process(&resultImage, &originalImage);
+
+    writePgmRawHeader(outfp, &resultImage);
+    writePgmRawBitmapData(outfp, &resultImage);
+
+    size_t actualLength;
+    unsigned char *actual = readWholeFile(outfp, &actualLength);
+    checkBytes(path, filter, corpus, expected, expectedLength, actual, actualLength);
+
+    free(actual);
+    freeImage(&originalImage);
+    freeImage(&resultImage);
+    fclose(infp);
+    fclose(outfp);
+
+    return;
+}
+
+/*======================================================================
+ * 3x3 のフィルタの確認
+ *======================================================================
+ *   1枚の合成画像について、すべての種類のフィルタを、画像全体の処理、
+ * 2回計算する処理、ストリーミング処理、複数同時の処理(通常と2回計算)
+ * で求め、元の処理と比べる。
+ */
+void checkStencils(corpus_image_t *corpus)
+{
+    unsigned char *expected[STENCIL_COUNT];
+    size_t expectedLength[STENCIL_COUNT];
+    image_t oracleImage;
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        initOracleImage(&oracleImage, corpus->image.width, corpus->image.height, corpus->image.maxValue);
+        oracleStencil(&oracleImage, &corpus->dense, k);
+        expected[k] = oraclePgm(&oracleImage, &expectedLength[k]);
+        freeImage(&oracleImage);
+    }
+
+    /* 画像全体の処理と、2回計算する処理 */
+    for (int i = 0; i < FILTER_COUNT; i++)
+    {
+        const filter_entry_t *filter = &filterEntries[i];
+        if (filter->stencil < 0)
+        {
+            continue;
+        }
+
+        setenv("FILTER_FUSED", "0", 1);
+        checkProcess("memory", filter->name, filter->process, corpus,
+                     expected[filter->stencil], expectedLength[filter->stencil]);
+        setenv("FILTER_FUSED", "1", 1);
+        checkProcess("fused", filter->name, filter->process, corpus,
+                     expected[filter->stencil], expectedLength[filter->stencil]);
+        unsetenv("FILTER_FUSED");
+
+        /* ストリーミング処理 */
+        FILE *infp = openCorpusFile(corpus);
+        FILE *outfp = tmpfile();
+        if (outfp == NULL)
+        {
+            fputs("Creating a temporary file was failed\n", stderr);
+            exit(1);
+        }
+        streamFilteringImage(infp, outfp, filter->stencil, filter->output);
+
+        size_t actualLength;
+        unsigned char *actual = readWholeFile(outfp, &actualLength);
+        checkBytes("stream", filter->name, corpus, expected[filter->stencil], expectedLength[filter->stencil],
+                   actual, actualLength);
+        free(actual);
+        fclose(infp);
+        fclose(outfp);
+    }
+
+    /* 複数同時の処理(すべての種類と、1つおきの種類) */
+    for (int mode = 0; mode < 4; mode++)
+    {
+        int fused = mode % 2;
+        int subset = mode / 2;
+        image_t resultImageData[STENCIL_COUNT];
+        image_t *resultImages[STENCIL_COUNT];
+
+        for (int k = 0; k < STENCIL_COUNT; k++)
+        {
+            resultImages[k] = NULL;
+            if (!subset || k % 2 == 0)
+            {
+                initImage(&resultImageData[k], corpus->image.width, corpus->image.height, corpus->image.maxValue);
+                resultImages[k] = &resultImageData[k];
+            }
+        }
+
+        setenv("FILTER_FUSED", fused ? "1" : "0", 1);
+        filterStencilMultiImage(&corpus->image, resultImages);
+        unsetenv("FILTER_FUSED");
+
+        for (int k = 0; k < STENCIL_COUNT; k++)
+        {
+            if (resultImages[k] == NULL)
+            {
+                continue;
+            }
+
+            static const char *paths[] = {"multi", "multi-fused", "multi-subset", "multi-subset-fused"};
+            size_t actualLength;
+            unsigned char *actual = oraclePgm(&resultImageData[k], &actualLength);
+            checkBytes(paths[mode], stencilNames[k], corpus, expected[k], expectedLength[k], actual, actualLength);
+            free(actual);
+            freeImage(&resultImageData[k]);
+        }
+    }
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        free(expected[k]);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 大津の方法による2値化の確認
+ *======================================================================
+ */
+void checkOtsu(corpus_image_t *corpus)
+{
+    image_t oracleImage;
+
+    /* 閾値 */
+    unsigned char expectedThreshold = (unsigned char)oracleThreshold(&corpus->dense);
+    unsigned char actualThreshold = (unsigned char)getThreshold(&corpus->image);
+    checkBytes("threshold", "otsu", corpus, &expectedThreshold, 1, &actualThreshold, 1);
+
+    /* 2値化した画像 */
+    initOracleImage(&oracleImage, corpus->image.width, corpus->image.height, corpus->image.maxValue);
+    oracleBinarization(&oracleImage, &corpus->dense);
+    size_t expectedLength;
+    unsigned char *expected = oraclePgm(&oracleImage, &expectedLength);
+
+    checkProcess("memory", "otsu", binarization, corpus, expected, expectedLength);
+
+    free(expected);
+    freeImage(&oracleImage);
+
+    return;
+}
+
+/*======================================================================
+ * カーネルの畳み込みの確認
+ *======================================================================
+ *   元の sample_1_*.c のカーネルと、分離できる/できない大きなカーネル
+ * について、planKernel() と convolveImage() の結果(int の値と最小値、
+ * 最大値)を、元の畳み込み演算と比べる。
+ */
+void checkKernels(corpus_image_t *corpus)
+{
+    static const int kernel3x3[][9] = {
+        {-1, 0, 1, -1, 0, 1, -1, 0, 1},
+        {-1, -1, -1, 0, 0, 0, 1, 1, 1},
+        {-1, 0, 1, -2, 0, 2, -1, 0, 1},
+        {-1, -2, -1, 0, 0, 0, 1, 2, 1},
+        {0, 1, 0, 1, -4, 1, 0, 1, 0},
+        {1, 1, 1, 1, -8, 1, 1, 1, 1}};
+    static const int binomial5[] = {1, 4, 6, 4, 1};
+    static const char *names[] = {"prewitt-x", "prewitt-y", "sobel-x", "sobel-y", "laplace4", "laplace8",
+                                  "binomial5x5", "dense7x3"};
+    int count = (int)(sizeof(names) / sizeof(names[0]));
+
+    for (int n = 0; n < count; n++)
+    {
+        kernel_t kernel;
+
+        if (n < 6)
+        {
+            initKernel(&kernel, 3, 3);
+            memcpy(kernel.data, kernel3x3[n], sizeof(kernel3x3[n]));
+        }
+        else if (n == 6)
+        {
+            initKernel(&kernel, 5, 5);
+            for (int j = 0; j < 5; j++)
+            {
+                for (int i = 0; i < 5; i++)
+                {
+                    kernel.data[i + 5 * j] = binomial5[i] * binomial5[j];
+                }
+            }
+        }
+        else
+        {
+            initKernel(&kernel, 7, 3);
+            for (int i = 0; i < 21; i++)
+            {
+                kernel.data[i] = synthHash(i, 0, 5) % 7 - 3;
+            }
+        }
+
+        int width = corpus->image.width;
+        int height = corpus->image.height;
+        int *expected = (int *)malloc(sizeof(int) * (width * height + 2));
+        int *actual = (int *)malloc(sizeof(int) * (width * height + 2));
+        if (expected == NULL || actual == NULL)
+        {
+            fputs("out of memory\n", stderr);
+            exit(1);
+        }
+
+        /* 元の畳み込み演算 */
+        padding_image_t oraclePadding;
+        oraclePaddingImage(&corpus->dense, &oraclePadding, kernel.width, kernel.height);
+        int minValue = 255;
+        int maxValue = 0;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                int g = oracleConvolution(x + oraclePadding.padding_x, y + oraclePadding.padding_y, &oraclePadding, &kernel);
+                expected[x + width * y] = g;
+                minValue = min(minValue, g);
+                maxValue = max(maxValue, g);
+            }
+        }
+        expected[width * height] = minValue;
+        expected[width * height + 1] = maxValue;
+
+        /* 解析したカーネルの畳み込み */
+        padding_image_t paddingImage;
+        kernel_plan_t plan;
+        initPaddingImage(&corpus->image, &paddingImage, kernel.width, kernel.height);
+        setPaddingImageData(&corpus->image, &paddingImage, kernel.width, kernel.height);
+        planKernel(&kernel, &plan);
+        convolveImage(&paddingImage, &kernel, &plan, actual, &actual[width * height], &actual[width * height + 1]);
+
+        checkBytes(plan.type == KERNEL_SEPARABLE ? "kernel-separable" : "kernel-dense", names[n], corpus,
+                   (unsigned char *)expected, sizeof(int) * (width * height + 2),
+                   (unsigned char *)actual, sizeof(int) * (width * height + 2));
+
+        freeKernelPlan(&plan);
+        freePaddingImage(&paddingImage);
+        free(oraclePadding.data);
+        free(expected);
+        free(actual);
+        free(kernel.data);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 画像の一部分を指す画像構造体の処理の確認
+ *======================================================================
+ *   合成画像の上下左右の1画素を除いた部分を viewImageRegion() で指し
+ * (画素値データはコピーせず、行の間隔は元の画像のまま)、登録されて
+ * いるすべてのフィルタで処理したものを、同じ部分を行の間を詰めてコピ
+ * ーした画像の元の処理の結果と比べる。
+ */
+void checkRegion(corpus_image_t *corpus)
+{
+    image_t view, crop, expectedImage, resultImage;
+
+    if (corpus->image.width < 3 || corpus->image.height < 3)
+    {
+        return;
+    }
+
+    viewImageRegion(&view, &corpus->image, 1, 1, corpus->image.width - 2, corpus->image.height - 2);
+    initOracleImage(&crop, view.width, view.height, view.maxValue);
+    copyImageData(&crop, &view);
+
+    for (int i = 0; i < FILTER_COUNT; i++)
+    {
+        const filter_entry_t *filter = &filterEntries[i];
+
+        initOracleImage(&expectedImage, view.width, view.height, view.maxValue);
+        if (filter->stencil >= 0)
+        {
+            oracleStencil(&expectedImage, &crop, filter->stencil);
+        }
+        else
+        {
+            oracleBinarization(&expectedImage, &crop);
+        }
+
+        initImage(&resultImage, view.width, view.height, view.maxValue);
+        filter->process(&resultImage, &view);
+
+        size_t expectedLength, actualLength;
+        unsigned char *expected = oraclePgm(&expectedImage, &expectedLength);
+        unsigned char *actual = oraclePgm(&resultImage, &actualLength);
+        checkBytes("region", filter->name, corpus, expected, expectedLength, actual, actualLength);
+
+        free(expected);
+        free(actual);
+        freeImage(&expectedImage);
+        freeImage(&resultImage);
+    }
+
+    freeImage(&crop);
+
+    return;
+}
+
+/*======================================================================
+ * 現在の命令セットとスレッド数での確認
+ *======================================================================
+ *   すべての合成画像について確認し、違いがなければ 0 を、あれば 1 を
+ * 返す。
+ */
+int runConformance(void)
+{
+    int images = 0;
+
+    /* 元の処理と同じ条件にする */
+    unsetenv("FILTER_BORDER");
+    unsetenv("FILTER_MAGNITUDE");
+    unsetenv("FILTER_STREAM");
+    unsetenv("FILTER_FUSED");
+    unsetenv("FILTER_TIMING");
+
+    /* 画像ごとの確認用の表示はしない */
+    showDiagnostics = 0;
+
+    for (int s = 0; s < CORPUS_SIZE_COUNT; s++)
+    {
+        for (int m = 0; m < CORPUS_MAX_VALUE_COUNT; m++)
+        {
+            for (int pattern = 0; pattern < CORPUS_PATTERN_COUNT; pattern++)
+            {
+                corpus_image_t corpus;
+
+                makeCorpusImage(&corpus, pattern, corpusSizes[s][0], corpusSizes[s][1], corpusMaxValues[m]);
+
+                checkStencils(&corpus);
+                checkOtsu(&corpus);
+                checkKernels(&corpus);
+                checkRegion(&corpus);
+
+                free(corpus.pgm);
+                freeImage(&corpus.image);
+                freeImage(&corpus.dense);
+                images++;
+            }
+        }
+    }
+
+    /* 閾値の候補が複数ある画像 */
+    for (int i = 0; i < OTSU_FIXTURE_COUNT; i++)
+    {
+        corpus_image_t corpus;
+
+        makeFixtureImage(&corpus, otsuFixtures[i]);
+        checkOtsu(&corpus);
+
+        free(corpus.pgm);
+        freeImage(&corpus.image);
+        freeImage(&corpus.dense);
+        images++;
+    }
+
+    printf("conformance: isa=%s, threads=%d, images=%d, checks=%d, failed=%d\n",
+           stencilIsaNames[getStencilIsa()], getThreadCount(), images, checkCount, failedCount);
+
+    return failedCount > 0 ? 1 : 0;
+}
+
+/*
+ * メイン
+ *   引数がない時は、命令セット(scalar, sse2, avx2)とスレッド数(1, 3)
+ * のすべての組み合わせについて、環境変数 FILTER_ISA、FILTER_THREADS
+ * を設定した子プロセスで --single を実行する(命令セットとスレッド数
+ * はプロセスの中では変えられないため)。どれかに違いがあれば 1 を返す。
+ */
+int main(int argc, char **argv)
+{
+    if (argc == 2 && strcmp(argv[1], "--single") == 0)
+    {
+        return runConformance();
+    }
+    if (argc != 1)
+    {
+        usage(argv[0]);
+    }
+
+#ifdef _WIN32
+    return runConformance();
+#else
+    static const char *threadCounts[] = {"1", "3"};
+    int runs = 0;
+    int failed = 0;
+
+    for (int isa = STENCIL_ISA_SCALAR; isa <= STENCIL_ISA_AVX2; isa++)
+    {
+        for (int t = 0; t < (int)(sizeof(threadCounts) / sizeof(threadCounts[0])); t++)
+        {
+            fflush(stdout);
+
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                fputs("fork was failed\n", stderr);
+                exit(1);
+            }
+            if (pid == 0)
+            {
+                char *childArgv[] = {argv[0], "--single", NULL};
+
+                setenv("FILTER_ISA", stencilIsaNames[isa], 1);
+                setenv("FILTER_THREADS", threadCounts[t], 1);
+                execvp(argv[0], childArgv);
+                fputs("exec was failed\n", stderr);
+                _exit(1);
+            }
+
+            int status;
+            if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                failed++;
+            }
+            runs++;
+        }
+    }
+
+    printf("conformance: runs=%d, failed=%d\n", runs, failed);
+
+    return failed > 0 ? 1 : 0;
+#endif
+}
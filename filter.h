@@ -0,0 +1,797 @@
+/*
+ * 畳み込みによるフィルタリング
+ *
+ *   sample_1_*.c のフィルタで共通に使う、カーネル、パディングを加えた
+ * 画像、画素値データがint16型の画像の構造体と、畳み込み演算、正規化
+ * をまとめる。
+ */
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "pgm.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STENCIL_X86
+#include <immintrin.h>
+#define STENCIL_SSE2_TARGET __attribute__((target("sse2")))
+#define STENCIL_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+/*
+ * 画素値データがint16型の画像構造体の定義
+ *   3x3 のフィルタの値(勾配の大きさで最大 2040、ラプラシアンで -2040
+ * から 2040)はint16に収まるので、フィルタリングと正規化の間の画像は
+ * 1画素2バイトで持つ。各行の先頭は IMAGE_ALIGNMENT バイトの境界に合
+ * わせる。
+ */
+typedef struct
+{
+    int width;           /* 画像の横方向の画素数 */
+    int height;          /* 画像の縦方向の画素数 */
+    int minValue;        /* 画素の値(明るさ)の最小値 */
+    int maxValue;        /* 画素の値(明るさ)の最大値 */
+    int16_t *data;       /* 画像の画素値データを格納する領域を指す */
+                         /* ポインタ */
+    int stride;          /* 行の先頭から次の行の先頭までの画素数 */
+    size_t capacity;     /* data の領域の画素数 */
+} int16_image_t;
+
+/*
+ * パディングを加えた画像構造体の定義
+ *   各行の先頭(左のパディングの位置)は IMAGE_ALIGNMENT バイトの境界
+ * に合わせる。
+ */
+typedef struct
+{
+    int width;           /* パディングを加えた画像の横方向の画素数 */
+    int height;          /* パディングを加えた画像の縦方向の画素数 */
+    int maxValue;        /* 画素の値(明るさ)の最大値 */
+    int padding_x;       /* パディングの横方向の画素数 */
+    int padding_y;       /* パディングの縦方向の画素数 */
+    unsigned char *data; /* パディングを加えた画像の画素値データを格納する領域を指す */
+                         /* ポインタ */
+    int stride;          /* 行の先頭から次の行の先頭までの画素数 */
+} padding_image_t;
+
+/*
+ * カーネル構造体の定義
+ */
+typedef struct
+{
+    int width;           /* カーネルの横方向の画素数 */
+    int height;          /* カーネルの縦方向の画素数 */
+    int *data;           /* カーネルの画素値データを格納する領域を指す */
+                         /* ポインタ */
+} kernel_t;
+
+/*
+ * 画像の外側の画素の補い方
+ */
+#define BORDER_ZERO 0      /* 0 とする(ゼロパディング) */
+#define BORDER_REPLICATE 1 /* 最も近い端の画素を繰り返す */
+#define BORDER_REFLECT 2   /* 端の画素を軸に折り返す(端の画素は繰り返さない) */
+
+static const char *borderNames[] = {"zero", "replicate", "reflect"};
+
+/*
+ * 命令セット
+ */
+#define STENCIL_ISA_SCALAR 0
+#define STENCIL_ISA_SSE2 1
+#define STENCIL_ISA_AVX2 2
+
+static const char *stencilIsaNames[] = {"scalar", "sse2", "avx2"};
+
+/*======================================================================
+ * 使用する命令セットの取得
+ *======================================================================
+ *   3x3 のフィルタ(stencil.h)と正規化で使う命令セットを返す。
+ *   cpuid で CPU が対応している命令セットを調べ、最も速いものを返す。
+ * 環境変数 FILTER_ISA に "scalar", "sse2", "avx2" を指定すると、CPU が
+ * 対応している範囲でそれを使う。結果は最初の呼び出しで決まる。
+ */
+int getStencilIsa(void)
+{
+    static int isa = -1;
+
+    if (isa >= 0)
+    {
+        return isa;
+    }
+
+    int supported = STENCIL_ISA_SCALAR;
+#ifdef STENCIL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        supported = STENCIL_ISA_SSE2;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        supported = STENCIL_ISA_AVX2;
+    }
+#endif
+
+    /* 環境変数による指定 */
+    int requested = supported;
+    const char *env = getenv("FILTER_ISA");
+    if (env != NULL)
+    {
+        for (int i = STENCIL_ISA_SCALAR; i <= STENCIL_ISA_AVX2; i++)
+        {
+            if (strcmp(env, stencilIsaNames[i]) == 0)
+            {
+                requested = i;
+            }
+        }
+    }
+
+    isa = requested < supported ? requested : supported;
+
+    return isa;
+}
+
+/*======================================================================
+ * カーネル構造体の初期化
+ *======================================================================
+ */
+void initKernel(kernel_t *ptKernel, int width, int height)
+{
+    ptKernel->width = width;
+    ptKernel->height = height;
+
+    /* メモリ領域の確保 */
+    ptKernel->data = (int *)malloc(sizeof(int)*(width * height));
+
+    if (ptKernel->data == NULL) /* メモリ確保ができなかった時はエラー */
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * パディングを加えた画像構造体の初期化
+ *======================================================================
+ */
+void initPaddingImage(image_t *originalImage, padding_image_t *ptPaddingImage, int kernel_width, int kernel_height)
+{
+    int original_image_width = originalImage->width;
+    int original_image_height = originalImage->height;
+
+    /* パディングの大きさ */
+    int padding_x = (kernel_width - 1) / 2;
+    int padding_y = (kernel_height - 1) / 2;
+
+    /* パディングを加えた画像のサイズ */
+    int width = original_image_width + padding_x * 2;
+    int height = original_image_height + padding_y * 2;
+    int maxValue = originalImage->maxValue;
+
+    ptPaddingImage->width = width;
+    ptPaddingImage->height = height;
+    ptPaddingImage->maxValue = maxValue;
+    ptPaddingImage->padding_x = padding_x;
+    ptPaddingImage->padding_y = padding_y;
+    ptPaddingImage->stride = getAlignedStride(width, sizeof(unsigned char));
+
+    /* メモリ領域の確保(各行の先頭を境界に合わせる) */
+    ptPaddingImage->data = (unsigned char *)alignedMalloc(sizeof(unsigned char) * ptPaddingImage->stride * height);
+
+    return;
+}
+
+/*======================================================================
+ * パディングを加えた画像構造体の解放
+ *======================================================================
+ */
+void freePaddingImage(padding_image_t *ptPaddingImage)
+{
+    alignedFree(ptPaddingImage->data);
+    ptPaddingImage->data = NULL;
+
+    return;
+}
+
+/*======================================================================
+ * int16型画像構造体の初期化
+ *======================================================================
+ * 画像構造体 int16_image_t *ptImage の画素数(width × height)
+ * を設定し、画素値データを格納するのに必要なメモリ領域を確保する。
+ */
+void initInt16Image(int16_image_t *ptImage, int width, int height)
+{
+    ptImage->width = width;
+    ptImage->height = height;
+    ptImage->stride = getAlignedStride(width, sizeof(int16_t));
+    ptImage->capacity = (size_t)ptImage->stride * (size_t)height;
+
+    /* メモリ領域の確保(各行の先頭を境界に合わせる) */
+    ptImage->data = (int16_t *)alignedMalloc(sizeof(int16_t) * ptImage->capacity);
+
+    return;
+}
+
+/*======================================================================
+ * 画素値データがint16型の画像構造体の再初期化
+ *======================================================================
+ *   画素値データがint16型の画像構造体 int16_image_t *ptImage を、画素数
+ * (width × height)の画像に使い回す。まだ領域がないか、足りない時だけ
+ * 確保し直す。初めて使う時は、data を NULL、capacity を 0 にしておく。
+ * 確保できない時は data を NULL にして -1 を返す。
+ */
+int tryReuseInt16Image(int16_image_t *ptImage, int width, int height)
+{
+    int stride = getAlignedStride(width, sizeof(int16_t));
+    size_t size = (size_t)stride * (size_t)height;
+
+    ptImage->width = width;
+    ptImage->height = height;
+    ptImage->stride = stride;
+
+    if (ptImage->data == NULL || size > ptImage->capacity)
+    {
+        alignedFree(ptImage->data);
+        ptImage->data = (int16_t *)tryAlignedMalloc(sizeof(int16_t) * size);
+        ptImage->capacity = ptImage->data != NULL ? size : 0;
+        if (ptImage->data == NULL)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *   tryReuseInt16Image() と同じだが、確保できない時はエラーとして終了す
+ * る。
+ */
+void reuseInt16Image(int16_image_t *ptImage, int width, int height)
+{
+    if (tryReuseInt16Image(ptImage, width, height) != 0)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * パディングを加えた画像の初期化
+ *======================================================================
+ */
+void setPaddingImageData(image_t *originalImage, padding_image_t *paddingImage, int kernel_width, int kernel_height)
+{
+    int original_image_stride = originalImage->stride;
+    int padding_image_stride = paddingImage->stride;
+
+    /* パディングの大きさ */
+    int padding_x = paddingImage->padding_x;
+    int padding_y = paddingImage->padding_y;
+
+    /* パディングを加えた画像のサイズ */
+    int padding_image_width = paddingImage->width;
+    int padding_image_height = paddingImage->height;
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    /* データのセット */
+    for (int y = 0; y < padding_image_height; y++)
+    {
+        for (int x = 0; x < padding_image_width; x++)
+        {
+            if (x < padding_x || x >= padding_image_width - padding_x || y < padding_y || y >= padding_image_height - padding_y)
+            {
+                /* ゼロパディング */
+                paddingImage->data[x + padding_image_stride * y] = 0;
+            }
+            else
+            {
+                paddingImage->data[x + padding_image_stride * y] = originalImage->data[(x - padding_x) + original_image_stride * (y - padding_y)];
+            }
+        }
+    }
+
+    endStage(&timer, "pad", (size_t)originalImage->width * originalImage->height +
+             (size_t)padding_image_width * padding_image_height * sizeof(paddingImage->data[0]),
+             (size_t)padding_image_width * padding_image_height);
+    return;
+}
+
+/*======================================================================
+ * 画像の外側の補い方の取得
+ *======================================================================
+ *   環境変数 FILTER_BORDER (zero, replicate, reflect) で指定された補い
+ * 方を返す。指定がなければ、元の処理と同じ BORDER_ZERO とする。
+ */
+int getBorderMode(void)
+{
+    const char *env = getenv("FILTER_BORDER");
+
+    if (env == NULL)
+    {
+        return BORDER_ZERO;
+    }
+    for (int i = 0; i < (int)(sizeof(borderNames) / sizeof(borderNames[0])); i++)
+    {
+        if (strcmp(env, borderNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    fputs("FILTER_BORDER must be zero, replicate or reflect\n", stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * 画像の外側の座標の変換
+ *======================================================================
+ *   大きさ n の範囲の外側かもしれない座標 i を、border の方法で範囲内
+ * の座標に変換して返す。BORDER_ZERO で範囲の外側の時は -1 を返す。
+ * 3x3 のフィルタで使うので、i は -1 から n までとする。
+ */
+int getBorderIndex(int i, int n, int border)
+{
+    if (i >= 0 && i < n)
+    {
+        return i;
+    }
+
+    switch (border)
+    {
+    case BORDER_REPLICATE:
+        return i < 0 ? 0 : n - 1;
+    case BORDER_REFLECT:
+        if (n == 1)
+        {
+            return 0;
+        }
+        return i < 0 ? -i : 2 * (n - 1) - i;
+    default:
+        return -1;
+    }
+}
+
+/*======================================================================
+ * 画像の外側を補った画素値の取得
+ *======================================================================
+ *   画像 image_t *image の (x, y) の画素値を返す。(x, y) が画像の外側
+ * の時は border の方法で補った値を返す。
+ */
+unsigned char getBorderPixel(image_t *image, int x, int y, int border)
+{
+    int bx = getBorderIndex(x, image->width, border);
+    int by = getBorderIndex(y, image->height, border);
+
+    if (bx < 0 || by < 0)
+    {
+        return 0;
+    }
+
+    return image->data[bx + image->stride * by];
+}
+
+/*======================================================================
+ * 畳み込み演算
+ *======================================================================
+ */
+int convolution(int x, int y, padding_image_t *paddingImage, kernel_t *kernel)
+{
+    int sum = 0;
+
+    int kernel_width = kernel->width;
+    int kernel_height = kernel->height;
+
+    int half_kernel_width = (kernel_width - 1) / 2;
+    int half_kernel_height = (kernel_height - 1) / 2;
+    for (int j = 0; j < kernel_height; j++)
+    {
+        for (int i = 0; i < kernel_width; i++)
+        {
+            int paddingImage_pixel = paddingImage->data[(x + (i - half_kernel_width)) + paddingImage->stride * (y + (j - half_kernel_height))];
+            int kernel_pixel = kernel->data[i + kernel_width * j];
+            sum += paddingImage_pixel * kernel_pixel;
+        }
+    }
+
+    return sum;
+}
+
+/*
+ * 正規化の変換表の要素数の上限
+ *   3x3 のフィルタの値の範囲(勾配の大きさで最大 2040)より十分大きく
+ * しておき、値の範囲がこれを超える時は変換表を作らずに1画素ずつ計算
+ * する。
+ */
+#define NORMALIZE_TABLE_MAX 65536
+
+/*
+ * 正規化の変換表構造体の定義
+ */
+typedef struct
+{
+    int minValue;        /* 変換前の最小値 */
+    int maxValue;        /* 変換前の最大値 */
+    int resultMaxValue;  /* 変換後の最大値 */
+    int *table;          /* minValue からの差を添字とする変換後の値 */
+                         /* (gather で読むので int。作らない時は NULL) */
+} normalize_table_t;
+
+/*======================================================================
+ * 1画素の正規化
+ *======================================================================
+ *   x'=255*(x-min)/(max-min) (x'の範囲[0, 255]) を、元の処理と同じ
+ * double の式で計算する。
+ */
+static inline unsigned char normalizePixel(int value, int minValue, int maxValue, int resultMaxValue)
+{
+    int result_image_pixel = (int)(((double)(value - minValue) / (double)(maxValue - minValue)) * (double)resultMaxValue);
+
+    return (unsigned char)result_image_pixel;
+}
+
+/*======================================================================
+ * 正規化の変換表の初期化
+ *======================================================================
+ *   最小値 minValue から最大値 maxValue までの値を 0 から
+ * resultMaxValue までに変換する表を作る。表の値は normalizePixel() で
+ * 計算するので、1画素ずつ計算した結果と完全に同じになる。画素ごとの
+ * double の除算が、画像ごとに (maxValue - minValue + 1) 回になる。
+ *   minValue == maxValue の時は、すべて 0 に変換する(元の式は 0 除算
+ * になり、x86 では結果が 0 になっていた)。
+ */
+void initNormalizeTable(normalize_table_t *ptTable, int minValue, int maxValue, int resultMaxValue)
+{
+    long long size = (long long)maxValue - (long long)minValue + 1;
+
+    ptTable->minValue = minValue;
+    ptTable->maxValue = maxValue;
+    ptTable->resultMaxValue = resultMaxValue;
+    ptTable->table = NULL;
+
+    if (size > NORMALIZE_TABLE_MAX)
+    {
+        return;
+    }
+
+    ptTable->table = (int *)malloc(sizeof(int) * (size_t)size);
+    if (ptTable->table == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    if (minValue == maxValue)
+    {
+        ptTable->table[0] = 0;
+        return;
+    }
+    for (int i = 0; i < (int)size; i++)
+    {
+        ptTable->table[i] = normalizePixel(minValue + i, minValue, maxValue, resultMaxValue);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 正規化の変換表の解放
+ *======================================================================
+ */
+void freeNormalizeTable(normalize_table_t *ptTable)
+{
+    free(ptTable->table);
+    ptTable->table = NULL;
+
+    return;
+}
+
+/*======================================================================
+ * 変換表の添字
+ *======================================================================
+ *   value - minValue を [0, range] に収める。値の範囲を求めた1回目の
+ * 走査と正規化する2回目の走査の間に入力が書き換えられると(ほかのプ
+ * ロセスが書き込める共有メモリの画像、読み直すファイルなど)、範囲の
+ * 外の値が来ることがあるので、表の外は読まずに 0 または resultMaxValue
+ * にする。範囲の中の値は変わらない。
+ */
+static inline int getNormalizeIndex(int value, int minValue, int range)
+{
+    int index = value - minValue;
+
+    return index < 0 ? 0 : (index > range ? range : index);
+}
+
+#ifdef STENCIL_X86
+/*======================================================================
+ * 変換表による1行の正規化(AVX2)
+ *======================================================================
+ *   32 画素ずつ、int16 の値を int32 に広げて変換表の値を gather でま
+ * とめて読み、8 bit に詰めて書き込む。32 画素に満たない残りは1画素ず
+ * つ表を引く。添字は normalizeRow() と同じく [0, range] に収める。
+ */
+STENCIL_AVX2_TARGET static void normalizeRowAvx2(const int16_t *in, unsigned char *out, int width,
+                                                 const int *table, int minValue, int range)
+{
+    const __m256i vmin = _mm256_set1_epi32(minValue);
+    const __m256i vzero = _mm256_setzero_si256();
+    const __m256i vrange = _mm256_set1_epi32(range);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i g[4];
+
+        for (int i = 0; i < 4; i++)
+        {
+            __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + x + 8 * i)));
+            __m256i index = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(v, vmin), vzero), vrange);
+            g[i] = _mm256_i32gather_epi32(table, index, 4);
+        }
+
+        /* 32 bit → 8 bit (パックは 128 bit ごとなので最後に並べ直す) */
+        __m256i b = _mm256_packus_epi16(_mm256_packs_epi32(g[0], g[1]), _mm256_packs_epi32(g[2], g[3]));
+        b = _mm256_permutevar8x32_epi32(b, order);
+        _mm256_storeu_si256((__m256i *)(out + x), b);
+    }
+    for (; x < width; x++)
+    {
+        out[x] = (unsigned char)table[getNormalizeIndex(in[x], minValue, range)];
+    }
+
+    return;
+}
+#endif
+
+/*======================================================================
+ * [0, 255]に正規化した1行の画像データのセット
+ *======================================================================
+ *   const int16_t *in の width 画素を、変換表 normalize_table_t *ptTable
+ * で変換して unsigned char *out にセットする。変換表がない時は1画素
+ * ずつ計算する。変換表の範囲の外の値は、範囲の端の値として変換する
+ * (getNormalizeIndex())。
+ */
+void normalizeRow(const int16_t *in, unsigned char *out, int width, const normalize_table_t *ptTable)
+{
+    const int *table = ptTable->table;
+    int minValue = ptTable->minValue;
+    int range = ptTable->maxValue - minValue;
+
+    if (table == NULL)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int value = minValue + getNormalizeIndex(in[x], minValue, range);
+
+            out[x] = normalizePixel(value, minValue, ptTable->maxValue, ptTable->resultMaxValue);
+        }
+        return;
+    }
+
+#ifdef STENCIL_X86
+    if (getStencilIsa() == STENCIL_ISA_AVX2)
+    {
+        normalizeRowAvx2(in, out, width, table, minValue, range);
+        return;
+    }
+#endif
+
+    for (int x = 0; x < width; x++)
+    {
+        out[x] = (unsigned char)table[getNormalizeIndex(in[x], minValue, range)];
+    }
+
+    return;
+}
+
+#ifdef STENCIL_X86
+/*======================================================================
+ * [0, 255]にクリッピングした1行の画像データのセット(SSE2)
+ *======================================================================
+ *   int16 から符号なし 8 bit への飽和パックで、16 画素ずつクリッピン
+ * グする。
+ */
+STENCIL_SSE2_TARGET static void clampRowSse2(const int16_t *in, unsigned char *out, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + x + 8));
+        _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(a, b));
+    }
+    for (; x < width; x++)
+    {
+        out[x] = in[x] < 0 ? 0 : (in[x] > 255 ? 255 : in[x]);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * [0, 255]にクリッピングした1行の画像データのセット(AVX2)
+ *======================================================================
+ *   clampRowSse2() と同じ処理を 32 画素ずつ行う。
+ */
+STENCIL_AVX2_TARGET static void clampRowAvx2(const int16_t *in, unsigned char *out, int width)
+{
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + x));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + x + 16));
+
+        /* パックは 128 bit ごとなので並べ直す */
+        __m256i c = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + x), c);
+    }
+    clampRowSse2(in + x, out + x, width - x);
+
+    return;
+}
+#endif
+
+/*======================================================================
+ * [0, 255]にクリッピングした1行の画像データのセット
+ *======================================================================
+ */
+void clampRow(const int16_t *in, unsigned char *out, int width)
+{
+#ifdef STENCIL_X86
+    switch (getStencilIsa())
+    {
+    case STENCIL_ISA_AVX2:
+        clampRowAvx2(in, out, width);
+        return;
+    case STENCIL_ISA_SSE2:
+        clampRowSse2(in, out, width);
+        return;
+    }
+#endif
+
+    for (int x = 0; x < width; x++)
+    {
+        // 範囲外の値は0or255にする
+        out[x] = in[x] < 0 ? 0 : (in[x] > 255 ? 255 : in[x]);
+    }
+
+    return;
+}
+
+/*
+ * 正規化、クリッピングの並列処理に渡す引数
+ */
+typedef struct
+{
+    int16_image_t *tmpImage;         /* 入力 */
+    image_t *resultImage;            /* 出力 */
+    const normalize_table_t *table;  /* 正規化の変換表 */
+} normalize_task_t;
+
+/*======================================================================
+ * [0, 255]に正規化した画像データのセット(帯ごとの処理)
+ *======================================================================
+ *   tmpImage の begin 行目から end-1 行目までを正規化して resultImage
+ * にセットする。
+ */
+static void normalizeRows(void *arg, int band, int begin, int end)
+{
+    normalize_task_t *task = (normalize_task_t *)arg;
+    int16_image_t *tmpImage = task->tmpImage;
+    image_t *resultImage = task->resultImage;
+
+    int tmp_image_width = tmpImage->width;
+
+    (void)band;
+
+    /* データのセット */
+    for (int y = begin; y < end; y++)
+    {
+        normalizeRow(tmpImage->data + (size_t)tmpImage->stride * y, resultImage->data + (size_t)resultImage->stride * y,
+                     tmp_image_width, task->table);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * [0, 255]に正規化した画像データのセット
+ *======================================================================
+ *   int16_image_t *tmpImage の画素値を、最小値 minValue から最大値
+ * maxValue までが 0 から resultImage->maxValue までになるように変換し
+ * て resultImage にセットする。変換表を画像ごとに1回作り、行を帯に分
+ * けて並列に表を引く。
+ */
+void setNormalizedImageData(int16_image_t *tmpImage, image_t *resultImage)
+{
+    /* サイズが違ったらエラー */
+    if (tmpImage->width != resultImage->width || tmpImage->height != resultImage->height)
+    {
+        fputs("tmpImage and resultImage are different size\n", stderr);
+        exit(1);
+    }
+
+    printDiagnostic("tmp_image: minValue=%d, maxValue=%d\n", tmpImage->minValue, tmpImage->maxValue);
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    normalize_table_t table;
+    initNormalizeTable(&table, tmpImage->minValue, tmpImage->maxValue, resultImage->maxValue);
+
+    normalize_task_t task = {tmpImage, resultImage, &table};
+    parallelFor(tmpImage->height, normalizeRows, &task);
+
+    freeNormalizeTable(&table);
+
+    size_t pixels = (size_t)tmpImage->width * tmpImage->height;
+    endStage(&timer, "normalize", pixels * (sizeof(int16_t) + 1), pixels);
+    return;
+}
+
+/*======================================================================
+ * [0, 255]にクリッピングした画像データのセット(帯ごとの処理)
+ *======================================================================
+ */
+static void clampRows(void *arg, int band, int begin, int end)
+{
+    normalize_task_t *task = (normalize_task_t *)arg;
+    int16_image_t *tmpImage = task->tmpImage;
+    image_t *resultImage = task->resultImage;
+
+    (void)band;
+
+    /* データのセット */
+    for (int y = begin; y < end; y++)
+    {
+        clampRow(tmpImage->data + (size_t)tmpImage->stride * y, resultImage->data + (size_t)resultImage->stride * y,
+                 tmpImage->width);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * [0, 255]にクリッピングした画像データのセット
+ *======================================================================
+ *   int16_image_t *tmpImage の画素値のうち、0 未満のものを 0 に、255 を
+ * 超えるものを 255 にして resultImage にセットする。行を帯に分けて並
+ * 列に処理する。
+ */
+void setClampedImageData(int16_image_t *tmpImage, image_t *resultImage)
+{
+    /* サイズが違ったらエラー */
+    if (tmpImage->width != resultImage->width || tmpImage->height != resultImage->height)
+    {
+        fputs("tmpImage and resultImage are different size\n", stderr);
+        exit(1);
+    }
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    normalize_task_t task = {tmpImage, resultImage, NULL};
+    parallelFor(tmpImage->height, clampRows, &task);
+
+    size_t pixels = (size_t)tmpImage->width * tmpImage->height;
+    endStage(&timer, "clamp", pixels * (sizeof(int16_t) + 1), pixels);
+    return;
+}
+
+#endif /* FILTER_H */
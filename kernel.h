@@ -0,0 +1,631 @@
+/*
+ * カーネルの解析と汎用の畳み込み
+ *
+ *   実行時に与えられる任意の大きさのカーネル kernel_t を解析して、画
+ * 像全体の畳み込みを行う。sample_1_*.c の 3x3 のフィルタは stencil.h
+ * で計算するので、ここは 7x7 や 15x15 などのカーネル用である。
+ *   カーネルが縦と横の1次元のカーネルの積(階数 1)に分解できる時は、
+ * 横方向と縦方向の1次元の畳み込みを順に行い、1画素あたりの積和を
+ * W×H 回から W+H 回に減らす。
+ *   どちらの場合も、カーネルは解析の時に 0 でない要素(タップ)の並び
+ * に変換しておき、同じ重みのタップは足し合わせてから1回だけ掛ける。
+ * 0 の要素は読まず、重みが ±1 のグループは掛け算をしない。
+ */
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "thread_pool.h"
+
+/*
+ * カーネルの計算方法
+ */
+#define KERNEL_DENSE 0     /* タップごとの積和を求める */
+#define KERNEL_SEPARABLE 1 /* 横方向と縦方向の1次元の畳み込みに分ける */
+
+/*
+ * 分離した畳み込みで、横方向の結果を一度に持つ領域の大きさ(バイト)
+ *   キャッシュに収まる行数ずつ横方向と縦方向の畳み込みを行う。
+ */
+#define KERNEL_BLOCK_BYTES (256 * 1024)
+
+/*
+ * タップの並びの構造体の定義
+ *   0 でない要素を重みの順に並べ、同じ重みのものを1つのグループにす
+ * る。g 番目のグループは ends[g-1] 番目(g == 0 の時は 0 番目)から
+ * ends[g]-1 番目までのタップで、重みは weights[g] である。
+ */
+typedef struct
+{
+    int count;           /* タップの数 */
+    int groupCount;      /* グループの数 */
+    int *x;              /* 各タップのカーネルの中の横方向の位置 */
+    int *y;              /* 各タップのカーネルの中の縦方向の位置 */
+    int *weights;        /* 各グループの重み */
+    int *ends;           /* 各グループの最後のタップの次の番号 */
+} kernel_taps_t;
+
+/*
+ * カーネルの解析結果の構造体の定義
+ */
+typedef struct
+{
+    int type;            /* 計算方法 */
+    int *horizontal;     /* 横方向の1次元のカーネル(width 要素) */
+    int *vertical;       /* 縦方向の1次元のカーネル(height 要素) */
+                         /* kernel->data[i + width * j] */
+                         /*   == vertical[j] * horizontal[i] */
+    kernel_taps_t taps;            /* カーネル全体のタップ */
+    kernel_taps_t horizontalTaps;  /* horizontal のタップ */
+    kernel_taps_t verticalTaps;    /* vertical のタップ(x は常に 0) */
+} kernel_plan_t;
+
+/*======================================================================
+ * 最大公約数
+ *======================================================================
+ */
+static int kernelGcd(int a, int b)
+{
+    a = a < 0 ? -a : a;
+    b = b < 0 ? -b : b;
+    while (b != 0)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/*======================================================================
+ * 分離できるカーネルかどうかの判定
+ *======================================================================
+ *   整数のカーネル kernel_t *kernel が、整数の縦ベクトル vertical と
+ * 横ベクトル horizontal の積に分解できるかどうかを調べ、できる時は
+ * 1 を返して両者をセットし、できない時は 0 を返す。
+ *   行列の階数が 1 以下であることは、0 でない要素 K[r][c] を1つ選んだ
+ * 時に、すべての j, i について 2x2 の小行列式
+ *     K[j][i] * K[r][c] - K[j][c] * K[r][i]
+ * が 0 になることと同じである。整数のまま計算するので、浮動小数点の
+ * SVD の打ち切り誤差による誤判定はない。
+ *   分解は、r 行目をその要素の最大公約数で割ったものを horizontal と
+ * し、vertical[j] = K[j][c] / horizontal[c] とする。各行は horizontal
+ * の有理数倍で、horizontal の要素の最大公約数は 1 なので、この商は割
+ * り切れる。
+ */
+int isSeparableKernel(kernel_t *kernel, int *horizontal, int *vertical)
+{
+    int width = kernel->width;
+    int height = kernel->height;
+    int *data = kernel->data;
+    int r = -1;
+    int c = -1;
+
+    /* 0 でない要素を探す */
+    for (int k = 0; k < width * height; k++)
+    {
+        if (data[k] != 0)
+        {
+            r = k / width;
+            c = k % width;
+            break;
+        }
+    }
+
+    /* すべて 0 */
+    if (r < 0)
+    {
+        memset(horizontal, 0, sizeof(int) * width);
+        memset(vertical, 0, sizeof(int) * height);
+        return 1;
+    }
+
+    /* 2x2 の小行列式がすべて 0 かどうか */
+    long long pivot = data[c + width * r];
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            if ((long long)data[i + width * j] * pivot != (long long)data[c + width * j] * data[i + width * r])
+            {
+                return 0;
+            }
+        }
+    }
+
+    /* 分解 */
+    int g = 0;
+    for (int i = 0; i < width; i++)
+    {
+        g = kernelGcd(g, data[i + width * r]);
+    }
+    for (int i = 0; i < width; i++)
+    {
+        horizontal[i] = data[i + width * r] / g;
+    }
+    for (int j = 0; j < height; j++)
+    {
+        vertical[j] = data[c + width * j] / horizontal[c];
+    }
+
+    return 1;
+}
+
+/*======================================================================
+ * タップの並びの作成
+ *======================================================================
+ *   width×height 要素の整数の配列 const int *data の 0 でない要素を、
+ * kernel_taps_t *taps にセットする。同じ重みのグループの中では元の並
+ * び順(行ごとに左から)を保つ。
+ */
+void compileKernelTaps(const int *data, int width, int height, kernel_taps_t *taps)
+{
+    int count = 0;
+
+    for (int k = 0; k < width * height; k++)
+    {
+        if (data[k] != 0)
+        {
+            count++;
+        }
+    }
+
+    /* count が 0 でも NULL にならないように1要素は確保する */
+    int n = count > 0 ? count : 1;
+    int *order = (int *)malloc(sizeof(int) * n);
+    taps->x = (int *)malloc(sizeof(int) * n);
+    taps->y = (int *)malloc(sizeof(int) * n);
+    taps->weights = (int *)malloc(sizeof(int) * n);
+    taps->ends = (int *)malloc(sizeof(int) * n);
+    if (order == NULL || taps->x == NULL || taps->y == NULL || taps->weights == NULL || taps->ends == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    /* 0 でない要素を重みの順に並べる(挿入ソート。要素数は少ない) */
+    count = 0;
+    for (int k = 0; k < width * height; k++)
+    {
+        if (data[k] == 0)
+        {
+            continue;
+        }
+
+        int t = count++;
+        while (t > 0 && data[order[t - 1]] > data[k])
+        {
+            order[t] = order[t - 1];
+            t--;
+        }
+        order[t] = k;
+    }
+
+    /* 同じ重みのグループに分ける */
+    taps->count = count;
+    taps->groupCount = 0;
+    for (int t = 0; t < count; t++)
+    {
+        int weight = data[order[t]];
+
+        taps->x[t] = order[t] % width;
+        taps->y[t] = order[t] / width;
+        if (taps->groupCount == 0 || taps->weights[taps->groupCount - 1] != weight)
+        {
+            taps->weights[taps->groupCount++] = weight;
+        }
+        taps->ends[taps->groupCount - 1] = t + 1;
+    }
+
+    free(order);
+
+    return;
+}
+
+/*======================================================================
+ * タップの並びの解放
+ *======================================================================
+ */
+void freeKernelTaps(kernel_taps_t *taps)
+{
+    free(taps->x);
+    free(taps->y);
+    free(taps->weights);
+    free(taps->ends);
+    taps->x = NULL;
+    taps->y = NULL;
+    taps->weights = NULL;
+    taps->ends = NULL;
+    taps->count = 0;
+    taps->groupCount = 0;
+
+    return;
+}
+
+/*======================================================================
+ * タップごとの積和(1行分)
+ *======================================================================
+ *   const unsigned char *src からの相対位置 offsets[t] + x の画素とタッ
+ * プ t の重みの積和を、x = 0 から width-1 まで int *dst に求める。グル
+ * ープごとに画素値を int *groupRow (width 要素の作業領域)に足し合わせ
+ * てから重みを1回掛け、重みが ±1 のグループは dst に直接足し引きする。
+ * 内側のループは x についての連続したアクセスなので、ベクトル化される。
+ */
+static void sumKernelTapsRow(const kernel_taps_t *taps, const int *offsets, const unsigned char *src,
+                             int *dst, int *groupRow, int width)
+{
+    memset(dst, 0, sizeof(int) * width);
+
+    for (int g = 0, t = 0; g < taps->groupCount; g++)
+    {
+        int weight = taps->weights[g];
+
+        if (weight == 1 || weight == -1)
+        {
+            for (; t < taps->ends[g]; t++)
+            {
+                const unsigned char *p = src + offsets[t];
+
+                if (weight == 1)
+                {
+                    for (int x = 0; x < width; x++)
+                    {
+                        dst[x] += p[x];
+                    }
+                }
+                else
+                {
+                    for (int x = 0; x < width; x++)
+                    {
+                        dst[x] -= p[x];
+                    }
+                }
+            }
+            continue;
+        }
+
+        /* 同じ重みのタップの画素値の和 */
+        const unsigned char *p = src + offsets[t++];
+        for (int x = 0; x < width; x++)
+        {
+            groupRow[x] = p[x];
+        }
+        for (; t < taps->ends[g]; t++)
+        {
+            p = src + offsets[t];
+            for (int x = 0; x < width; x++)
+            {
+                groupRow[x] += p[x];
+            }
+        }
+
+        for (int x = 0; x < width; x++)
+        {
+            dst[x] += weight * groupRow[x];
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * タップの相対位置の計算
+ *======================================================================
+ *   1行が stride 要素の領域で、カーネルの左上の要素に対する各タップの
+ * 相対位置を求めて、確保した配列で返す。
+ */
+static int *getKernelTapOffsets(const kernel_taps_t *taps, int stride)
+{
+    int *offsets = (int *)malloc(sizeof(int) * (taps->count > 0 ? taps->count : 1));
+
+    if (offsets == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    for (int t = 0; t < taps->count; t++)
+    {
+        offsets[t] = taps->x[t] + stride * taps->y[t];
+    }
+
+    return offsets;
+}
+
+/*======================================================================
+ * カーネルの解析
+ *======================================================================
+ *   カーネル kernel_t *kernel の計算方法を決めて kernel_plan_t *plan に
+ * セットする。カーネルの値を変えた時は、解析し直す。
+ */
+void planKernel(kernel_t *kernel, kernel_plan_t *plan)
+{
+    plan->horizontal = (int *)malloc(sizeof(int) * kernel->width);
+    plan->vertical = (int *)malloc(sizeof(int) * kernel->height);
+    if (plan->horizontal == NULL || plan->vertical == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    plan->type = isSeparableKernel(kernel, plan->horizontal, plan->vertical) ? KERNEL_SEPARABLE : KERNEL_DENSE;
+
+    /* 0 でない要素の並び */
+    compileKernelTaps(kernel->data, kernel->width, kernel->height, &plan->taps);
+    if (plan->type == KERNEL_SEPARABLE)
+    {
+        compileKernelTaps(plan->horizontal, kernel->width, 1, &plan->horizontalTaps);
+        compileKernelTaps(plan->vertical, 1, kernel->height, &plan->verticalTaps);
+    }
+    else
+    {
+        kernel_taps_t empty = {0, 0, NULL, NULL, NULL, NULL};
+        plan->horizontalTaps = empty;
+        plan->verticalTaps = empty;
+    }
+
+    return;
+}
+
+/*======================================================================
+ * カーネルの解析結果の解放
+ *======================================================================
+ */
+void freeKernelPlan(kernel_plan_t *plan)
+{
+    free(plan->horizontal);
+    free(plan->vertical);
+    plan->horizontal = NULL;
+    plan->vertical = NULL;
+    freeKernelTaps(&plan->taps);
+    freeKernelTaps(&plan->horizontalTaps);
+    freeKernelTaps(&plan->verticalTaps);
+
+    return;
+}
+
+/*
+ * 畳み込みの並列処理に渡す引数
+ */
+typedef struct
+{
+    padding_image_t *paddingImage;
+    kernel_t *kernel;
+    kernel_plan_t *plan;
+    int *out;                   /* 出力(元の画像と同じ大きさ) */
+    int minValues[MAX_THREADS]; /* 帯ごとの最小値 */
+    int maxValues[MAX_THREADS]; /* 帯ごとの最大値 */
+} convolve_task_t;
+
+/*======================================================================
+ * 分離した畳み込み(帯ごとの処理)
+ *======================================================================
+ *   出力画像の begin 行目から end-1 行目までを、キャッシュに収まる行数
+ * ずつ、横方向の畳み込みを int の作業領域に求めてから、縦方向の畳み込
+ * みを行って出力する。
+ */
+static void convolveSeparableRows(convolve_task_t *task, int band, int begin, int end)
+{
+    padding_image_t *paddingImage = task->paddingImage;
+    int kernel_height = task->kernel->height;
+    const kernel_taps_t *horizontalTaps = &task->plan->horizontalTaps;
+    const kernel_taps_t *verticalTaps = &task->plan->verticalTaps;
+    int width = paddingImage->width - paddingImage->padding_x * 2;
+    int minValue = task->minValues[band];
+    int maxValue = task->maxValues[band];
+
+    /* 一度に処理する出力の行数 */
+    int bufferRows = KERNEL_BLOCK_BYTES / (int)(sizeof(int) * width);
+    if (bufferRows < kernel_height)
+    {
+        bufferRows = kernel_height;
+    }
+    int blockRows = bufferRows - (kernel_height - 1);
+
+    int *buffer = (int *)malloc(sizeof(int) * width * bufferRows);
+    int *groupRow = (int *)malloc(sizeof(int) * width);
+    if (buffer == NULL || groupRow == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    /* 横方向のタップの相対位置 */
+    int *offsets = getKernelTapOffsets(horizontalTaps, 0);
+
+    for (int y0 = begin; y0 < end; y0 += blockRows)
+    {
+        int y1 = y0 + blockRows < end ? y0 + blockRows : end;
+
+        /* 横方向(パディングを加えた画像の y0 行目から y1+kernel_height-2 行目) */
+        for (int py = y0; py < y1 + kernel_height - 1; py++)
+        {
+            const unsigned char *src = paddingImage->data + (size_t)paddingImage->stride * py;
+
+            sumKernelTapsRow(horizontalTaps, offsets, src, buffer + width * (py - y0), groupRow, width);
+        }
+
+        /* 縦方向 */
+        for (int y = y0; y < y1; y++)
+        {
+            int *dst = task->out + width * y;
+
+            for (int x = 0; x < width; x++)
+            {
+                dst[x] = 0;
+            }
+            for (int g = 0, t = 0; g < verticalTaps->groupCount; g++)
+            {
+                int weight = verticalTaps->weights[g];
+
+                for (; t < verticalTaps->ends[g]; t++)
+                {
+                    const int *src = buffer + width * (y - y0 + verticalTaps->y[t]);
+
+                    if (weight == 1)
+                    {
+                        for (int x = 0; x < width; x++)
+                        {
+                            dst[x] += src[x];
+                        }
+                    }
+                    else if (weight == -1)
+                    {
+                        for (int x = 0; x < width; x++)
+                        {
+                            dst[x] -= src[x];
+                        }
+                    }
+                    else
+                    {
+                        for (int x = 0; x < width; x++)
+                        {
+                            dst[x] += weight * src[x];
+                        }
+                    }
+                }
+            }
+            for (int x = 0; x < width; x++)
+            {
+                if (minValue > dst[x])
+                {
+                    minValue = dst[x];
+                }
+                if (maxValue < dst[x])
+                {
+                    maxValue = dst[x];
+                }
+            }
+        }
+    }
+
+    free(offsets);
+    free(groupRow);
+    free(buffer);
+
+    task->minValues[band] = minValue;
+    task->maxValues[band] = maxValue;
+
+    return;
+}
+
+/*======================================================================
+ * 畳み込み(帯ごとの処理)
+ *======================================================================
+ */
+static void convolveBand(void *arg, int band, int begin, int end)
+{
+    convolve_task_t *task = (convolve_task_t *)arg;
+    padding_image_t *paddingImage = task->paddingImage;
+    int width = paddingImage->width - paddingImage->padding_x * 2;
+
+    task->minValues[band] = 255;
+    task->maxValues[band] = 0;
+
+    if (task->plan->type == KERNEL_SEPARABLE)
+    {
+        convolveSeparableRows(task, band, begin, end);
+        return;
+    }
+
+    /* カーネルの左上の要素に対するタップの相対位置 */
+    int *offsets = getKernelTapOffsets(&task->plan->taps, paddingImage->stride);
+    int *groupRow = (int *)malloc(sizeof(int) * width);
+    if (groupRow == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    int minValue = 255;
+    int maxValue = 0;
+
+    for (int y = begin; y < end; y++)
+    {
+        /* パディングを加えた画像では、出力の (x, y) に対するカーネルの */
+        /* 左上は (x, y) にある */
+        const unsigned char *src = paddingImage->data + (size_t)paddingImage->stride * y;
+
+        int *dst = task->out + width * y;
+
+        sumKernelTapsRow(&task->plan->taps, offsets, src, dst, groupRow, width);
+        for (int x = 0; x < width; x++)
+        {
+            if (minValue > dst[x])
+            {
+                minValue = dst[x];
+            }
+            if (maxValue < dst[x])
+            {
+                maxValue = dst[x];
+            }
+        }
+    }
+
+    free(offsets);
+    free(groupRow);
+
+    task->minValues[band] = minValue;
+    task->maxValues[band] = maxValue;
+
+    return;
+}
+
+/*======================================================================
+ * 画像全体の畳み込み
+ *======================================================================
+ *   パディングを加えた画像 padding_image_t *paddingImage の元の画像の
+ * 全画素について、カーネル kernel_t *kernel との積和を、planKernel()
+ * で決めた方法で求めて int *out (元の画像の画素数)にセットし、その
+ * 最小値(初期値 255)と最大値(初期値 0)を *minValue, *maxValue にセッ
+ * トする。どの方法でも、結果は convolution() と同じになる。
+ *   出力画像の行を帯に分けてスレッドプールで並列に計算する。
+ */
+void convolveImage(padding_image_t *paddingImage, kernel_t *kernel, kernel_plan_t *plan,
+                   int *out, int *minValue, int *maxValue)
+{
+    convolve_task_t *task = (convolve_task_t *)malloc(sizeof(convolve_task_t));
+    if (task == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    task->paddingImage = paddingImage;
+    task->kernel = kernel;
+    task->plan = plan;
+    task->out = out;
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    int bands = parallelFor(paddingImage->height - paddingImage->padding_y * 2, convolveBand, task);
+
+    *minValue = 255;
+    *maxValue = 0;
+    for (int i = 0; i < bands; i++)
+    {
+        if (*minValue > task->minValues[i])
+        {
+            *minValue = task->minValues[i];
+        }
+        if (*maxValue < task->maxValues[i])
+        {
+            *maxValue = task->maxValues[i];
+        }
+    }
+
+    size_t pixels = (size_t)(paddingImage->width - paddingImage->padding_x * 2) *
+                    (paddingImage->height - paddingImage->padding_y * 2);
+    endStage(&timer, "convolve", (size_t)paddingImage->width * paddingImage->height *
+             sizeof(paddingImage->data[0]) + pixels * sizeof(int), pixels);
+
+    free(task);
+
+    return;
+}
+
+#endif /* KERNEL_H */
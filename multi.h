@@ -0,0 +1,680 @@
+/*
+ * 複数のフィルタの同時計算
+ *
+ *   同じ画像に STENCIL_LIST の複数の 3x3 のフィルタをかける時に、各画
+ * 素の 3x3 の近傍を1回だけ読み込み、同じループの中で指定した種類のフ
+ * ィルタの値を求める。画像の読み込みも1回で済む。指定した種類は
+ * 1 << 種類 の和(kinds)で渡し、指定していない種類は計算しない(種類ご
+ * との判定はループの中で変わらないので、分岐の予測は外れない)。種類ご
+ * との値は stencil.h と同じ関数で計算するので、結果は1種類ずつ計算し
+ * た場合と同じになる。
+ */
+#ifndef MULTI_H
+#define MULTI_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "filter.h"
+#include "stencil.h"
+#include "thread_pool.h"
+
+/*
+ * 種類ごとの結果画像への変換方法
+ */
+#define STENCIL_OUTPUT_ENTRY(kind, name, output) [kind] = output,
+static const int stencilOutputs[] = {STENCIL_LIST(STENCIL_OUTPUT_ENTRY)};
+
+/*
+ * 1画素分の値の書き込みと、最小値、最大値の更新
+ */
+#define updateMultiValue(outs, minValues, maxValues, x, kind, g) \
+    do                                                           \
+    {                                                            \
+        int g_ = (g);                                            \
+        if ((outs)[kind] != NULL)                                \
+        {                                                        \
+            (outs)[kind][x] = (int16_t)g_;                       \
+        }                                                        \
+        if ((minValues)[kind] > g_)                              \
+        {                                                        \
+            (minValues)[kind] = g_;                              \
+        }                                                        \
+        if ((maxValues)[kind] < g_)                              \
+        {                                                        \
+            (maxValues)[kind] = g_;                              \
+        }                                                        \
+    } while (0)
+
+/*======================================================================
+ * 1行分の複数の種類のステンシル演算(スカラー)
+ *======================================================================
+ *   出力画像の x0 列目から x1-1 列目までについて、kinds で指定した種類
+ * のフィルタの値を求め、種類 k の値を outs[k] にセット(NULL の時はセ
+ * ットしない)し、最小値 minValues[k]、最大値 maxValues[k] を更新する。
+ */
+static void stencilMultiRowScalar(const unsigned char *row0, const unsigned char *row1,
+                                  const unsigned char *row2, int16_t *const *outs, int x0, int x1,
+                                  int *minValues, int *maxValues, unsigned kinds)
+{
+    for (int x = x0; x < x1; x++)
+    {
+#define STENCIL_MULTI_SCALAR(kind, name, output)                                                            \
+        if (kinds & (1u << (kind)))                                                                         \
+        {                                                                                                   \
+            updateMultiValue(outs, minValues, maxValues, x, kind, stencilPixel(row0, row1, row2, x, kind)); \
+        }
+        STENCIL_LIST(STENCIL_MULTI_SCALAR)
+#undef STENCIL_MULTI_SCALAR
+    }
+
+    return;
+}
+
+#ifdef STENCIL_X86
+/*======================================================================
+ * 8画素分の複数の種類のステンシル演算(SSE2)
+ *======================================================================
+ *   int16 に広げた近傍から、kinds で指定した種類のフィルタの値を求めて
+ * outs[k] の xi 列目からセットし、vmin[k]、vmax[k] を更新する。近傍は
+ * レジスタに置いたまま、種類ごとに stencilSse2() を呼ぶ(共通の部分式
+ * はコンパイラがまとめる)。
+ */
+static inline STENCIL_SSE2_TARGET void stencilMultiSse2(__m128i p00, __m128i p01, __m128i p02,
+                                                        __m128i p10, __m128i p11, __m128i p12,
+                                                        __m128i p20, __m128i p21, __m128i p22,
+                                                        int16_t *const *outs, int xi,
+                                                        __m128i *vmin, __m128i *vmax, unsigned kinds)
+{
+    __m128i r;
+
+#define STENCIL_MULTI_SSE2(kind, name, output)                              \
+    if (kinds & (1u << (kind)))                                             \
+    {                                                                       \
+        r = stencilSse2(p00, p01, p02, p10, p11, p12, p20, p21, p22, kind); \
+        vmin[kind] = _mm_min_epi16(vmin[kind], r);                          \
+        vmax[kind] = _mm_max_epi16(vmax[kind], r);                          \
+        if (outs[kind] != NULL)                                             \
+        {                                                                   \
+            _mm_storeu_si128((__m128i *)(outs[kind] + xi), r);              \
+        }                                                                   \
+    }
+    STENCIL_LIST(STENCIL_MULTI_SSE2)
+#undef STENCIL_MULTI_SSE2
+
+    return;
+}
+
+/*======================================================================
+ * 1行分の複数の種類のステンシル演算(SSE2)
+ *======================================================================
+ *   stencilMultiRowScalar() と同じ計算を 16 画素ずつ行う。
+ */
+static STENCIL_SSE2_TARGET void stencilMultiRowSse2(const unsigned char *row0, const unsigned char *row1,
+                                                    const unsigned char *row2, int16_t *const *outs, int x0, int x1,
+                                                    int *minValues, int *maxValues, unsigned kinds)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i vmin[STENCIL_COUNT], vmax[STENCIL_COUNT];
+    int x = x0;
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        vmin[k] = _mm_set1_epi16((short)minValues[k]);
+        vmax[k] = _mm_set1_epi16((short)maxValues[k]);
+    }
+
+    for (; x + 16 <= x1; x += 16)
+    {
+        __m128i a00 = _mm_loadu_si128((const __m128i *)(row0 + x - 1));
+        __m128i a01 = _mm_loadu_si128((const __m128i *)(row0 + x));
+        __m128i a02 = _mm_loadu_si128((const __m128i *)(row0 + x + 1));
+        __m128i a10 = _mm_loadu_si128((const __m128i *)(row1 + x - 1));
+        __m128i a11 = _mm_loadu_si128((const __m128i *)(row1 + x));
+        __m128i a12 = _mm_loadu_si128((const __m128i *)(row1 + x + 1));
+        __m128i a20 = _mm_loadu_si128((const __m128i *)(row2 + x - 1));
+        __m128i a21 = _mm_loadu_si128((const __m128i *)(row2 + x));
+        __m128i a22 = _mm_loadu_si128((const __m128i *)(row2 + x + 1));
+
+        stencilMultiSse2(_mm_unpacklo_epi8(a00, zero), _mm_unpacklo_epi8(a01, zero), _mm_unpacklo_epi8(a02, zero),
+                         _mm_unpacklo_epi8(a10, zero), _mm_unpacklo_epi8(a11, zero), _mm_unpacklo_epi8(a12, zero),
+                         _mm_unpacklo_epi8(a20, zero), _mm_unpacklo_epi8(a21, zero), _mm_unpacklo_epi8(a22, zero),
+                         outs, x, vmin, vmax, kinds);
+        stencilMultiSse2(_mm_unpackhi_epi8(a00, zero), _mm_unpackhi_epi8(a01, zero), _mm_unpackhi_epi8(a02, zero),
+                         _mm_unpackhi_epi8(a10, zero), _mm_unpackhi_epi8(a11, zero), _mm_unpackhi_epi8(a12, zero),
+                         _mm_unpackhi_epi8(a20, zero), _mm_unpackhi_epi8(a21, zero), _mm_unpackhi_epi8(a22, zero),
+                         outs, x + 8, vmin, vmax, kinds);
+    }
+
+    /* 最小値、最大値の集約 */
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        short lanes_min[8], lanes_max[8];
+        _mm_storeu_si128((__m128i *)lanes_min, vmin[k]);
+        _mm_storeu_si128((__m128i *)lanes_max, vmax[k]);
+        for (int i = 0; i < 8; i++)
+        {
+            if (minValues[k] > lanes_min[i])
+            {
+                minValues[k] = lanes_min[i];
+            }
+            if (maxValues[k] < lanes_max[i])
+            {
+                maxValues[k] = lanes_max[i];
+            }
+        }
+    }
+
+    /* 残りの画素 */
+    stencilMultiRowScalar(row0, row1, row2, outs, x, x1, minValues, maxValues, kinds);
+
+    return;
+}
+
+/*======================================================================
+ * 16画素分の複数の種類のステンシル演算(AVX2)
+ *======================================================================
+ */
+static inline STENCIL_AVX2_TARGET void stencilMultiAvx2(__m256i p00, __m256i p01, __m256i p02,
+                                                        __m256i p10, __m256i p11, __m256i p12,
+                                                        __m256i p20, __m256i p21, __m256i p22,
+                                                        int16_t *const *outs, int xi,
+                                                        __m256i *vmin, __m256i *vmax, unsigned kinds)
+{
+    __m256i r;
+
+#define STENCIL_MULTI_AVX2(kind, name, output)                              \
+    if (kinds & (1u << (kind)))                                             \
+    {                                                                       \
+        r = stencilAvx2(p00, p01, p02, p10, p11, p12, p20, p21, p22, kind); \
+        vmin[kind] = _mm256_min_epi16(vmin[kind], r);                       \
+        vmax[kind] = _mm256_max_epi16(vmax[kind], r);                       \
+        if (outs[kind] != NULL)                                             \
+        {                                                                   \
+            _mm256_storeu_si256((__m256i *)(outs[kind] + xi), r);           \
+        }                                                                   \
+    }
+    STENCIL_LIST(STENCIL_MULTI_AVX2)
+#undef STENCIL_MULTI_AVX2
+
+    return;
+}
+
+/*======================================================================
+ * 1行分の複数の種類のステンシル演算(AVX2)
+ *======================================================================
+ *   stencilMultiRowScalar() と同じ計算を 16 画素ずつ行う。種類ごとの
+ * 最小値、最大値のレジスタが多いので、stencilRowAvx2Kind() のように
+ * 32 画素ずつにはしない。
+ */
+static STENCIL_AVX2_TARGET void stencilMultiRowAvx2(const unsigned char *row0, const unsigned char *row1,
+                                                    const unsigned char *row2, int16_t *const *outs, int x0, int x1,
+                                                    int *minValues, int *maxValues, unsigned kinds)
+{
+    __m256i vmin[STENCIL_COUNT], vmax[STENCIL_COUNT];
+    int x = x0;
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        vmin[k] = _mm256_set1_epi16((short)minValues[k]);
+        vmax[k] = _mm256_set1_epi16((short)maxValues[k]);
+    }
+
+    for (; x + 16 <= x1; x += 16)
+    {
+        stencilMultiAvx2(loadWidenAvx2(row0 + x - 1), loadWidenAvx2(row0 + x), loadWidenAvx2(row0 + x + 1),
+                         loadWidenAvx2(row1 + x - 1), loadWidenAvx2(row1 + x), loadWidenAvx2(row1 + x + 1),
+                         loadWidenAvx2(row2 + x - 1), loadWidenAvx2(row2 + x), loadWidenAvx2(row2 + x + 1),
+                         outs, x, vmin, vmax, kinds);
+    }
+
+    /* 最小値、最大値の集約 */
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        short lanes_min[16], lanes_max[16];
+        _mm256_storeu_si256((__m256i *)lanes_min, vmin[k]);
+        _mm256_storeu_si256((__m256i *)lanes_max, vmax[k]);
+        for (int i = 0; i < 16; i++)
+        {
+            if (minValues[k] > lanes_min[i])
+            {
+                minValues[k] = lanes_min[i];
+            }
+            if (maxValues[k] < lanes_max[i])
+            {
+                maxValues[k] = lanes_max[i];
+            }
+        }
+    }
+
+    /* 残りの画素 */
+    stencilMultiRowScalar(row0, row1, row2, outs, x, x1, minValues, maxValues, kinds);
+
+    return;
+}
+#endif /* STENCIL_X86 */
+
+/*======================================================================
+ * 1行分の複数の種類のステンシル演算(命令セットの選択)
+ *======================================================================
+ */
+static void stencilMultiRow(int isa, const unsigned char *row0, const unsigned char *row1,
+                            const unsigned char *row2, int16_t *const *outs, int x0, int x1,
+                            int *minValues, int *maxValues, unsigned kinds)
+{
+    switch (isa)
+    {
+#ifdef STENCIL_X86
+    case STENCIL_ISA_AVX2:
+        stencilMultiRowAvx2(row0, row1, row2, outs, x0, x1, minValues, maxValues, kinds);
+        break;
+    case STENCIL_ISA_SSE2:
+        stencilMultiRowSse2(row0, row1, row2, outs, x0, x1, minValues, maxValues, kinds);
+        break;
+#endif
+    default:
+        stencilMultiRowScalar(row0, row1, row2, outs, x0, x1, minValues, maxValues, kinds);
+        break;
+    }
+
+    return;
+}
+
+/*
+ * 複数の種類のステンシル演算の並列処理に渡す引数
+ */
+typedef struct
+{
+    image_t *image;
+    int16_image_t **tmpImages;                 /* 種類ごとの出力(NULL は出力しない) */
+    image_t **resultImages;                    /* 種類ごとの変換した出力(tmpImages を */
+                                               /* 使わない時。NULL は出力しない) */
+    normalize_table_t *tables;                 /* 種類ごとの正規化の変換表 */
+    unsigned kinds;                            /* 計算する種類(1 << 種類 の和) */
+    int border;
+    int minValues[MAX_THREADS][STENCIL_COUNT]; /* 帯ごと、種類ごとの最小値 */
+    int maxValues[MAX_THREADS][STENCIL_COUNT]; /* 帯ごと、種類ごとの最大値 */
+} stencil_multi_task_t;
+
+/*======================================================================
+ * 複数の種類のステンシル演算(帯ごとの処理)
+ *======================================================================
+ *   各行の近傍の3行を、左右に1画素ずつ border の方法で補った作業用の
+ * 行に並べてから計算する。行ごとのコピーは 3×幅 バイトで、6種類の
+ * フィルタの計算に比べて小さい。
+ *   resultImages がある時は、1行ずつ作業用の行に求めた値を、すぐに
+ * 種類ごとの方法で変換して書き込む。
+ */
+static void stencilMultiBand(void *arg, int band, int begin, int end)
+{
+    stencil_multi_task_t *task = (stencil_multi_task_t *)arg;
+    image_t *image = task->image;
+    int width = image->width;
+    int height = image->height;
+    int border = task->border;
+    int isa = getStencilIsa();
+    int16_t *outs[STENCIL_COUNT];
+
+    unsigned char *work = (unsigned char *)malloc(sizeof(unsigned char) * 3 * (width + 2));
+    int16_t *values = (int16_t *)malloc(sizeof(int16_t) * width * STENCIL_COUNT);
+    if (work == NULL || values == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        task->minValues[band][k] = 255;
+        task->maxValues[band][k] = 0;
+    }
+
+    for (int y = begin; y < end; y++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            unsigned char *line = work + (width + 2) * j;
+            int sy = getBorderIndex(y + j - 1, height, border);
+
+            if (sy < 0)
+            {
+                memset(line, 0, width + 2);
+            }
+            else
+            {
+                line[0] = getBorderPixel(image, -1, sy, border);
+                memcpy(line + 1, image->data + (size_t)image->stride * sy, width);
+                line[width + 1] = getBorderPixel(image, width, sy, border);
+            }
+        }
+
+        for (int k = 0; k < STENCIL_COUNT; k++)
+        {
+            if (task->resultImages != NULL)
+            {
+                outs[k] = task->resultImages[k] != NULL ? values + (size_t)width * k : NULL;
+            }
+            else
+            {
+                outs[k] = task->tmpImages[k] != NULL ? task->tmpImages[k]->data + (size_t)task->tmpImages[k]->stride * y : NULL;
+            }
+        }
+
+        stencilMultiRow(isa, work + 1, work + (width + 2) + 1, work + 2 * (width + 2) + 1,
+                        outs, 0, width, task->minValues[band], task->maxValues[band], task->kinds);
+
+        /* 変換して書き込む */
+        for (int k = 0; task->resultImages != NULL && k < STENCIL_COUNT; k++)
+        {
+            if (outs[k] == NULL)
+            {
+                continue;
+            }
+
+            unsigned char *out = task->resultImages[k]->data + (size_t)task->resultImages[k]->stride * y;
+            if (stencilOutputs[k] == STENCIL_OUTPUT_NORMALIZE)
+            {
+                normalizeRow(outs[k], out, width, &task->tables[k]);
+            }
+            else
+            {
+                clampRow(outs[k], out, width);
+            }
+        }
+    }
+
+    free(work);
+    free(values);
+
+    return;
+}
+
+/*======================================================================
+ * 複数の種類のステンシル演算によるフィルタリング
+ *======================================================================
+ *   画像 image_t *image の全画素について、すべての種類のフィルタの値を
+ * 求め、種類 k の値を int16_image_t *tmpImages[k] (NULL でないもの)に、
+ * 最小値(初期値 255)、最大値(初期値 0)と一緒にセットする。画像の外側
+ * は border の方法で補う。
+ */
+void stencilMultiImage(image_t *image, int16_image_t **tmpImages, int border)
+{
+    stencil_multi_task_t *task = (stencil_multi_task_t *)malloc(sizeof(stencil_multi_task_t));
+    if (task == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    task->image = image;
+    task->tmpImages = tmpImages;
+    task->resultImages = NULL;
+    task->tables = NULL;
+    task->kinds = 0;
+    task->border = border;
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (tmpImages[k] != NULL)
+        {
+            task->kinds |= 1u << k;
+        }
+    }
+
+    /* 使用する命令セットを並列処理の前に決めておく */
+    getStencilIsa();
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    int bands = parallelFor(image->height, stencilMultiBand, task);
+
+    size_t pixels = (size_t)image->width * image->height;
+    size_t bytes = pixels;
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (tmpImages[k] == NULL)
+        {
+            continue;
+        }
+        bytes += pixels * sizeof(int16_t);
+
+        tmpImages[k]->minValue = 255;
+        tmpImages[k]->maxValue = 0;
+        for (int i = 0; i < bands; i++)
+        {
+            if (tmpImages[k]->minValue > task->minValues[i][k])
+            {
+                tmpImages[k]->minValue = task->minValues[i][k];
+            }
+            if (tmpImages[k]->maxValue < task->maxValues[i][k])
+            {
+                tmpImages[k]->maxValue = task->maxValues[i][k];
+            }
+        }
+    }
+
+    endStage(&timer, "convolve", bytes, pixels);
+
+    free(task);
+
+    return;
+}
+
+/*======================================================================
+ * 複数の種類のステンシル演算を2回行うフィルタリング
+ *======================================================================
+ *   resultImages[k] が NULL でない種類 k のフィルタの値を、種類ごとの
+ * 方法で変換して resultImages[k] にセットする。stencilFusedImage() と
+ * 同じく、画像全体のフィルタの値(tmpImage)は作らず、正規化する種類が
+ * ある時は、1回目に最小値と最大値だけを求めて、2回目に計算し直して
+ * 書き込む。
+ */
+void stencilMultiFusedImage(image_t *image, image_t **resultImages, int border)
+{
+    normalize_table_t tables[STENCIL_COUNT];
+    int16_image_t *noImages[STENCIL_COUNT] = {NULL};
+    int normalize = 0;
+    stage_timer_t timer;
+    size_t pixels = (size_t)image->width * image->height;
+    size_t bytes = pixels;
+
+    stencil_multi_task_t *task = (stencil_multi_task_t *)malloc(sizeof(stencil_multi_task_t));
+    if (task == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    task->image = image;
+    task->tmpImages = noImages;
+    task->resultImages = NULL;
+    task->tables = tables;
+    task->kinds = 0;
+    task->border = border;
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (resultImages[k] != NULL && stencilOutputs[k] == STENCIL_OUTPUT_NORMALIZE)
+        {
+            normalize = 1;
+            task->kinds |= 1u << k;
+        }
+        if (resultImages[k] != NULL)
+        {
+            bytes += pixels;
+        }
+    }
+
+    /* 使用する命令セットを並列処理の前に決めておく */
+    getStencilIsa();
+
+    /* 1回目(最小値、最大値) */
+    if (normalize)
+    {
+        beginStage(&timer);
+
+        int bands = parallelFor(image->height, stencilMultiBand, task);
+
+        endStage(&timer, "convolve", pixels, pixels);
+
+        for (int k = 0; k < STENCIL_COUNT; k++)
+        {
+            if (resultImages[k] == NULL || stencilOutputs[k] != STENCIL_OUTPUT_NORMALIZE)
+            {
+                continue;
+            }
+
+            int minValue = 255;
+            int maxValue = 0;
+            for (int i = 0; i < bands; i++)
+            {
+                if (minValue > task->minValues[i][k])
+                {
+                    minValue = task->minValues[i][k];
+                }
+                if (maxValue < task->maxValues[i][k])
+                {
+                    maxValue = task->maxValues[i][k];
+                }
+            }
+
+            printDiagnostic("%s: tmp_image minValue=%d, maxValue=%d\n", stencilNames[k], minValue, maxValue);
+            initNormalizeTable(&tables[k], minValue, maxValue, resultImages[k]->maxValue);
+        }
+    }
+
+    /* 2回目(変換して書き込む) */
+    task->resultImages = resultImages;
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (resultImages[k] != NULL)
+        {
+            task->kinds |= 1u << k;
+        }
+    }
+    beginStage(&timer);
+    parallelFor(image->height, stencilMultiBand, task);
+    endStage(&timer, "convolve_output", bytes, pixels);
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (resultImages[k] != NULL && stencilOutputs[k] == STENCIL_OUTPUT_NORMALIZE)
+        {
+            freeNormalizeTable(&tables[k]);
+        }
+    }
+    free(task);
+
+    return;
+}
+
+/*======================================================================
+ * 複数の 3x3 のフィルタによるフィルタリング
+ *======================================================================
+ *   元画像 image_t *originalImage に、resultImages[k] が NULL でない種
+ * 類 k のフィルタを同時にかけ、種類ごとの変換方法(STENCIL_LIST)で
+ * [0, 255] の値にして resultImages[k] にセットする。各結果画像は
+ * filterStencilImage() で1種類ずつ求めたものと同じになる。環境変数
+ * FILTER_FUSED が 0 以外の時は、tmpImage を作らずに2回計算する。
+ */
+void filterStencilMultiImage(image_t *originalImage, image_t **resultImages)
+{
+    /* 種類ごとの値がint16型のtmpImage(スレッドごとに使い回す) */
+    static __thread int16_image_t tmpImageData[STENCIL_COUNT];
+    int16_image_t *tmpImages[STENCIL_COUNT];
+    image_t *magnitudeImages[STENCIL_COUNT];
+
+    int border = getBorderMode();
+    int fused = getFusedMode();
+
+    /* 勾配の大きさを近似する時は、sqrt を使う種類の出力を近似する種類に移す */
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        magnitudeImages[k] = NULL;
+    }
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (resultImages[k] != NULL)
+        {
+            if (magnitudeImages[getMagnitudeStencil(k)] != NULL)
+            {
+                fputs("the same filter is specified twice\n", stderr);
+                exit(1);
+            }
+            magnitudeImages[getMagnitudeStencil(k)] = resultImages[k];
+        }
+    }
+    resultImages = magnitudeImages;
+
+    /* 各要素の確認 */
+    printDiagnostic("original_image: width=%d, height=%d, maxValue=%d\n", originalImage->width, originalImage->height, originalImage->maxValue);
+    printDiagnostic("stencil: isa=%s, threads=%d, border=%s, fused=%d, multi=", stencilIsaNames[getStencilIsa()], getThreadCount(), borderNames[border], fused);
+
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        tmpImages[k] = NULL;
+        if (resultImages[k] == NULL)
+        {
+            continue;
+        }
+
+        /* サイズが違ったらエラー */
+        if (resultImages[k]->width != originalImage->width || resultImages[k]->height != originalImage->height)
+        {
+            fputs("resultImage and originalImage are different size\n", stderr);
+            exit(1);
+        }
+
+        if (!fused)
+        {
+            reuseInt16Image(&tmpImageData[k], originalImage->width, originalImage->height);
+            tmpImages[k] = &tmpImageData[k];
+        }
+        printDiagnostic(" %s", stencilNames[k]);
+    }
+    printDiagnostic("\n");
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (resultImages[k] != NULL && (k == STENCIL_PREWITT_AMBM || k == STENCIL_SOBEL_AMBM))
+        {
+            printMagnitudeError(k);
+            break;
+        }
+    }
+
+    if (fused)
+    {
+        /* フィルタリングと変換(tmpImagesを作らずにresultImagesにセット) */
+        stencilMultiFusedImage(originalImage, resultImages, border);
+        return;
+    }
+
+    /* フィルタリング(すべての種類の値と最小値、最大値をtmpImagesにセット) */
+    stencilMultiImage(originalImage, tmpImages, border);
+
+    /* [0, 255]に変換したものをresultImagesにセット */
+    for (int k = 0; k < STENCIL_COUNT; k++)
+    {
+        if (tmpImages[k] == NULL)
+        {
+            continue;
+        }
+
+        printDiagnostic("output: %s\n", stencilNames[k]);
+        if (stencilOutputs[k] == STENCIL_OUTPUT_NORMALIZE)
+        {
+            setNormalizedImageData(tmpImages[k], resultImages[k]);
+        }
+        else
+        {
+            setClampedImageData(tmpImages[k], resultImages[k]);
+        }
+    }
+
+    return;
+}
+
+#endif /* MULTI_H */
@@ -0,0 +1,321 @@
+/*
+ * 大津の方法による2値化
+ *
+ *   画像のヒストグラムからクラス間分散が最大となる閾値を求め、閾値以下
+ * の画素を 0、それより大きい画素を 255 にする。sample_2.c と、フィル
+ * タを名前で選ぶ sample_filter.c で使う。
+ */
+#ifndef OTSU_H
+#define OTSU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <math.h>
+
+#include "pgm.h"
+
+/*======================================================================
+ * ヒストグラムの作成
+ *======================================================================
+ *   画像構造体 image_t *ptImage の全画素を1回だけ走査して、各画素値
+ * の出現回数を int histogram[256] に格納する。
+ *   同じ画素値が連続すると、同じカウンタへの書き込みと読み込みが続い
+ * てストアからロードへの待ちが発生するため、4本の部分ヒストグラムに
+ * 振り分けて数え、最後に足し合わせる。
+ */
+#define HISTOGRAM_LANES 4
+
+void getHistogram(image_t *ptImage, int histogram[256])
+{
+    int lanes[HISTOGRAM_LANES][256] = {{0}};
+    int width = ptImage->width;
+
+    // 行の間隔が幅と同じ時は、画像全体を1行として数える
+    int rows = ptImage->stride == width ? 1 : ptImage->height;
+    int N = rows == 1 ? width * ptImage->height : width;
+
+    for (int y = 0; y < rows; y++)
+    {
+        unsigned char *data = ptImage->data + (size_t)ptImage->stride * y;
+        int j = 0;
+
+        // 4画素ずつ別々の部分ヒストグラムに数える
+        for (; j + HISTOGRAM_LANES <= N; j += HISTOGRAM_LANES)
+        {
+            lanes[0][data[j]]++;
+            lanes[1][data[j + 1]]++;
+            lanes[2][data[j + 2]]++;
+            lanes[3][data[j + 3]]++;
+        }
+        // 残りの画素
+        for (; j < N; j++)
+        {
+            lanes[0][data[j]]++;
+        }
+    }
+
+    // 部分ヒストグラムの合計
+    for (int i = 0; i < 256; i++)
+    {
+        histogram[i] = lanes[0][i] + lanes[1][i] + lanes[2][i] + lanes[3][i];
+    }
+
+    return;
+}
+
+/*======================================================================
+ * ヒストグラムから閾値を求める(大津の方法)
+ *======================================================================
+ *   ヒストグラム int histogram[256] から、クラス間分散
+ *     sigma = omega0 * (mu0 - mut)^2 + omega1 * (mu1 - mut)^2
+ *           = omega0 * omega1 * (mu0 - mu1)^2
+ * が最大となる閾値 k を求める。
+ *   まず、クラス0(画素値 <= k)の画素数 n0 と画素値の総和 s0 を整数の
+ * まま累積しながら1回だけ走査して、各 k の sigma を倍精度で求め、その
+ * 最大値 maxSigma を求める。
+ *   元の処理(sample_2.c)は sigma を float で求めるので、sigma がほぼ
+ * 同じ候補が複数ある時は、丸めによって最初の候補とは限らないものを選
+ * ぶ。同じ閾値を選ぶように、sigma が maxSigma から float の丸めの誤差
+ * の上限(getOtsuRoundingBound())以内の候補だけについて、元の処理と同
+ * じ float の演算を同じ順に行って sigma を求め直し、その中で最初に最大
+ * となる k を選ぶ。それ以外の候補は、元の処理でも最大にはならない。求
+ * め直す候補は、通常は十数個以下である。
+ *   元の処理と同じ float のクラス0の累積は、同じ走査でまとめて求める。
+ * クラス1の累積は候補ごとに足す順が違うので、候補ごとに求める。
+ *   画素のない画素値 k は、その前の画素のある画素値と同じ分け方になっ
+ * て sigma が変わらず、最大値を更新しないので候補から外す。どちらかの
+ * クラスが空になる k(元の処理では 0 / 0 の NaN となって選ばれない)も
+ * 候補から外す。
+ */
+
+/*
+ * 候補の omega1, mu1 をまとめて求める数
+ */
+#define OTSU_LANES 16
+
+/*
+ * 元の処理の float の sigma と、正確な sigma との差の上限
+ *   画素のある画素値が m 個、最大の画素値が maxLevel の時、float の和
+ * (m 項)の相対誤差は (m + 2) * u (u は float の丸めの単位)以下で、平
+ * 均 mu0, mu1, mut の誤差は 3 * (m + 2) * u * maxLevel 以下、それらの
+ * 差 d の誤差 delta は、余裕を見てその倍とする。omega * |d| <=
+ * sqrt(sigma) なので、sigma の誤差は 4 * delta * sqrt(sigma) +
+ * delta^2 + 4 * (m + 2) * u * sigma 以下になる。
+ */
+static double getOtsuRoundingBound(int m, int maxLevel, double sigma)
+{
+    double g = (m + 2) * (FLT_EPSILON / 2);
+    double delta = 8.0 * g * maxLevel;
+
+    return 4.0 * delta * sqrt(sigma) + delta * delta + 4.0 * g * sigma;
+}
+
+int getThresholdFromHistogram(int histogram[256])
+{
+    long long N = 0;
+    long long S = 0;
+
+    // 全画素数と画素値の総和
+    for (int i = 0; i < 256; i++)
+    {
+        N += histogram[i];
+        S += (long long)i * histogram[i];
+    }
+
+    // 元の処理と同じ float の確率と画素値 * 確率
+    float pi[256];
+    float value[256];
+    for (int i = 0; i < 256; i++)
+    {
+        pi[i] = (float)histogram[i] / (float)N;
+        value[i] = (float)i * pi[i];
+    }
+
+    // 画素値の小さい順に1回だけ走査して、
+    //   ・正確な sigma(どちらかのクラスが空の時は 0 / 0 の NaN で、最大
+    //     値 maxSigma を更新しない)
+    //   ・元の処理と同じ float のクラス0の累積 omega0s, mu0s
+    //   ・画素のある画素値の数 m と最大の画素値 maxLevel
+    // を求める
+    double sigmas[256];
+    double maxSigma = 0;
+    int m = 0;
+    int maxLevel = 0;
+    float omega0s[256];
+    float mu0s[256];
+    float omega0 = 0;
+    float mu0 = 0;
+    long long n0 = 0;
+    long long s0 = 0;
+    for (int k = 0; k < 256; k++)
+    {
+        omega0 += pi[k];
+        mu0 += value[k];
+        omega0s[k] = omega0;
+        mu0s[k] = mu0;
+
+        n0 += histogram[k];
+        s0 += (long long)k * histogram[k];
+
+        // 分散(元の処理と同じく画素数の割合で表す)
+        //   n0 * n1 * (mu0 - mu1)^2 = (s0 * N - S * n0)^2 / (n0 * n1)
+        double diff = (double)s0 * (double)N - (double)S * (double)n0;
+        sigmas[k] = diff * diff / ((double)n0 * (double)(N - n0) * (double)N * (double)N);
+        maxSigma = sigmas[k] > maxSigma ? sigmas[k] : maxSigma;
+
+        m += histogram[k] != 0;
+        maxLevel = histogram[k] != 0 ? k : maxLevel;
+    }
+    // 画素値が1種類以下の時は、どの k でもどちらかのクラスが空になる
+    if (m < 2)
+    {
+        return 0;
+    }
+    // 全体の平均は、クラス0の累積の最後と同じ和になる
+    float mut = mu0s[255];
+
+    // 元の処理で最大になりうる候補(画素のない画素値は、その前の画素の
+    // ある画素値と float の sigma も同じになるので外す)
+    double lowerSigma = maxSigma - 2.0 * getOtsuRoundingBound(m, maxLevel, maxSigma);
+    int candidates[256];
+    int count = 0;
+    for (int k = 0; k < 256; k++)
+    {
+        candidates[count] = k;
+        count += (histogram[k] != 0) & (sigmas[k] >= lowerSigma);
+    }
+
+    // 候補ごとのクラス1の omega1, mu1(k + 1 から小さい順に足す)。候補
+    // ごとの和は互いに依存しないので、OTSU_LANES 個の候補の和をまとめて
+    // 画素値ごとに足す。まとめた最後の候補が足し始めるまでは、まだ足し
+    // 始めない候補には 0 を足す(和は変わらない)。最大の画素値より後は
+    // 0 を足すだけなので足さない(余った枠は最後の候補と同じ計算をする)
+    float omega1[256 + OTSU_LANES];
+    float mu1[256 + OTSU_LANES];
+    int starts[256 + OTSU_LANES];
+    for (int c = 0; c < count + OTSU_LANES; c++)
+    {
+        omega1[c] = 0;
+        mu1[c] = 0;
+        starts[c] = candidates[c < count ? c : count - 1] + 1;
+    }
+    for (int b = 0; b < count; b += OTSU_LANES)
+    {
+        float *o = omega1 + b;
+        float *u = mu1 + b;
+        const int *st = starts + b;
+        int i = st[0];
+
+        for (; i < st[OTSU_LANES - 1]; i++)
+        {
+            float p = pi[i];
+            float v = value[i];
+
+            for (int l = 0; l < OTSU_LANES; l++)
+            {
+                float po = st[l] <= i ? p : 0.0f;
+                float vo = st[l] <= i ? v : 0.0f;
+
+                o[l] += po;
+                u[l] += vo;
+            }
+        }
+        for (; i <= maxLevel; i++)
+        {
+            for (int l = 0; l < OTSU_LANES; l++)
+            {
+                o[l] += pi[i];
+                u[l] += value[i];
+            }
+        }
+    }
+
+    // 候補について元の処理と同じ演算で sigma を求め直す
+    int T = 0;
+    float max_sigma = 0;
+    for (int c = 0; c < count; c++)
+    {
+        int k = candidates[c];
+
+        // 分散(pow(x, 2) は、float の x では double の x * x と同じ)
+        double d0 = mu0s[k] / omega0s[k] - mut;
+        double d1 = mu1[c] / omega1[c] - mut;
+        float sigma = omega0s[k] * (d0 * d0) + omega1[c] * (d1 * d1);
+        if (sigma > max_sigma)
+        {
+            max_sigma = sigma;
+            T = k;
+        }
+    }
+
+    return T;
+}
+
+/*======================================================================
+ * 閾値を求める
+ *======================================================================
+ */
+int getThreshold(image_t *originalImage)
+{
+    int ni[256] = {0};
+    stage_timer_t timer;
+
+    beginStage(&timer);
+
+    // ヒストグラム
+    getHistogram(originalImage, ni);
+
+    int threshold = getThresholdFromHistogram(ni);
+
+    size_t pixels = (size_t)originalImage->width * originalImage->height;
+    endStage(&timer, "threshold", pixels, pixels);
+
+    return threshold;
+}
+
+/*======================================================================
+ * 2値化
+ *======================================================================
+ */
+void binarization(image_t *resultImage, image_t *originalImage)
+{
+    /* サイズが違ったらエラー */
+    if (resultImage->width != originalImage->width || resultImage->height != originalImage->height)
+    {
+        fputs("resultImage and originalImage are different size\n", stderr);
+        exit(1);
+    }
+
+    int threshold = getThreshold(originalImage);
+    int N = originalImage->width * originalImage->height;
+
+    printDiagnostic("threshold = %d\n", threshold);
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    // 2値化
+    for (int y = 0; y < originalImage->height; y++)
+    {
+        unsigned char *in = originalImage->data + (size_t)originalImage->stride * y;
+        unsigned char *out = resultImage->data + (size_t)resultImage->stride * y;
+
+        for (int x = 0; x < originalImage->width; x++)
+        {
+            if (in[x] <= threshold)
+            {
+                out[x] = 0;
+            }
+            else
+            {
+                out[x] = 255;
+            }
+        }
+    }
+
+    endStage(&timer, "binarization", (size_t)N * 2, (size_t)N);
+    return;
+}
+
+#endif /* OTSU_H */
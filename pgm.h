@@ -0,0 +1,920 @@
+/*
+ * PGM-RAW 画像の入出力
+ *
+ *   各プログラム(sample_*.c)は1つのソースファイルからなり、このヘッ
+ * ダをインクルードして、画像構造体と PGM-RAW フォーマットの読み書き
+ * を共有する。
+ */
+#ifndef PGM_H
+#define PGM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/*
+ * 画素値データの行の先頭の境界(バイト数)
+ *   確保する画素値データの各行の先頭をキャッシュラインの境界に合わせ、
+ * ベクトル命令の読み書きがキャッシュラインをまたがないようにする。
+ */
+#define IMAGE_ALIGNMENT 64
+
+/*
+ * 画像構造体の定義
+ *   y 行目の画素値データは data + stride * y から始まる。確保した画像
+ * の stride は width を IMAGE_ALIGNMENT の倍数に切り上げたもので、ファ
+ * イルを割り当てた画像などでは width と同じ。
+ */
+typedef struct
+{
+    int width;           /* 画像の横方向の画素数 */
+    int height;          /* 画像の縦方向の画素数 */
+    int maxValue;        /* 画素の値(明るさ)の最大値 */
+    unsigned char *data; /* 画像の画素値データを格納する領域を指す */
+                         /* ポインタ */
+    int stride;          /* 行の先頭から次の行の先頭までの画素数 */
+    void *mapAddress;    /* data がファイルを割り当てた領域の中を指す */
+    size_t mapLength;    /* 時の、割り当て領域の先頭と大きさ */
+                         /* (malloc した時は NULL と 0) */
+    size_t loadedLength; /* 読み込み済みの画素値データのバイト数 */
+    size_t capacity;     /* 確保した data の領域のバイト数 */
+} image_t;
+
+/*
+ * 処理内容の確認用の表示をするかどうか(バッチ処理では表示しない)
+ */
+int showDiagnostics = 1;
+
+#define printDiagnostic(...)       \
+    do                             \
+    {                              \
+        if (showDiagnostics)       \
+        {                          \
+            printf(__VA_ARGS__);   \
+        }                          \
+    } while (0)
+
+/*======================================================================
+ * このプログラムに与えられた引数の解析
+ *======================================================================
+ */
+void parseArg(int argc, char **argv, FILE **infp, FILE **outfp)
+{
+    /* 引数の個数をチェック */
+    if (argc != 3)
+    {
+        goto usage;
+    }
+
+    *infp = fopen(argv[1], "rb"); /* 入力画像ファイルをバイナリモードで */
+                                  /* オープン */
+
+    if (*infp == NULL) /* オープンできない時はエラー */
+    {
+        fputs("Opening the input file was failend\n", stderr);
+        goto usage;
+    }
+
+    *outfp = fopen(argv[2], "wb"); /* 出力画像ファイルをバイナリモードで */
+                                   /* オープン */
+
+    if (*outfp == NULL) /* オープンできない時はエラー */
+    {
+        fputs("Opening the output file was failend\n", stderr);
+        goto usage;
+    }
+
+    return;
+
+/* このプログラムの使い方の説明 */
+usage:
+    fprintf(stderr, "usage : %s <input pgm file> <output pgm file>\n", argv[0]);
+    exit(1);
+}
+
+/*======================================================================
+ * 経過時間計測用の時刻の取得
+ *======================================================================
+ *   単調増加する時計の現在時刻を秒単位で返す。
+ */
+double getTime(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*======================================================================
+ * CPU 時間の取得
+ *======================================================================
+ *   このプロセスの全スレッドが使った CPU 時間を秒単位で返す。
+ */
+double getCpuTime(void)
+{
+#ifdef _WIN32
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+
+    GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+
+    return ((double)(((unsigned long long)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime) +
+            (double)(((unsigned long long)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime)) * 1e-7;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*
+ * 処理の段階ごとの時間計測
+ *   環境変数 FILTER_TIMING が 0 以外の時に、読み込み、パディング、畳み
+ * 込み、正規化、閾値、2値化、書き込みの各段階の経過時間、CPU 時間、読
+ * み書きしたバイト数、1秒あたりの画素数を、1段階につき1行の JSON で標
+ * 準エラー出力に書く。指定しない時は、段階ごとに変数を1つ調べるだけ
+ * にする。
+ */
+typedef struct
+{
+    double wallTime; /* 段階の開始時刻 */
+    double cpuTime;  /* 段階の開始時の CPU 時間 */
+} stage_timer_t;
+
+static int stageTimingMode = -1; /* -1 はまだ環境変数を調べていない */
+
+/*======================================================================
+ * 段階ごとの時間計測を行うかどうかの取得
+ *======================================================================
+ */
+int getTimingMode(void)
+{
+    if (stageTimingMode < 0)
+    {
+        const char *env = getenv("FILTER_TIMING");
+        stageTimingMode = env != NULL && strcmp(env, "0") != 0;
+    }
+
+    return stageTimingMode;
+}
+
+/*======================================================================
+ * 段階の開始
+ *======================================================================
+ */
+void beginStage(stage_timer_t *timer)
+{
+    if (!getTimingMode())
+    {
+        return;
+    }
+
+    timer->wallTime = getTime();
+    timer->cpuTime = getCpuTime();
+
+    return;
+}
+
+/*======================================================================
+ * 段階の終了
+ *======================================================================
+ *   beginStage() からの経過時間と CPU 時間を、段階の名前 stage、読み書
+ * きしたバイト数 bytes、処理した画素数 pixels と一緒に書き出す。
+ */
+void endStage(stage_timer_t *timer, const char *stage, size_t bytes, size_t pixels)
+{
+    if (!getTimingMode())
+    {
+        return;
+    }
+
+    double wallTime = getTime() - timer->wallTime;
+    double cpuTime = getCpuTime() - timer->cpuTime;
+
+    fprintf(stderr, "{\"stage\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes\":%zu,\"pixels\":%zu,\"mpixels_per_s\":%.1f}\n",
+            stage, wallTime * 1000.0, cpuTime * 1000.0, bytes, pixels,
+            wallTime > 0.0 ? (double)pixels / wallTime * 1e-6 : 0.0);
+
+    return;
+}
+
+/*======================================================================
+ * 境界に合わせたメモリ領域の確保
+ *======================================================================
+ *   先頭が IMAGE_ALIGNMENT バイトの境界にある size バイトの領域を確保
+ * する。確保できない時は NULL を返す。alignedFree() で解放する。
+ */
+void *tryAlignedMalloc(size_t size)
+{
+    void *p;
+
+#ifdef _WIN32
+    p = _aligned_malloc(size > 0 ? size : 1, IMAGE_ALIGNMENT);
+#else
+    if (posix_memalign(&p, IMAGE_ALIGNMENT, size > 0 ? size : 1) != 0)
+    {
+        p = NULL;
+    }
+#endif
+
+    return p;
+}
+
+/*
+ *   tryAlignedMalloc() と同じだが、確保できない時はエラーとして終了す
+ * る。
+ */
+void *alignedMalloc(size_t size)
+{
+    void *p = tryAlignedMalloc(size);
+
+    if (p == NULL) /* メモリ確保ができなかった時はエラー */
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    return p;
+}
+
+/*======================================================================
+ * 境界に合わせたメモリ領域の解放
+ *======================================================================
+ */
+void alignedFree(void *p)
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+
+    return;
+}
+
+/*======================================================================
+ * 境界に合わせた行の間隔の取得
+ *======================================================================
+ *   1画素 elementSize バイトで width 画素の行を並べる時に、各行の先頭
+ * が IMAGE_ALIGNMENT バイトの境界に来る行の間隔(画素数)を返す。
+ */
+int getAlignedStride(int width, size_t elementSize)
+{
+    int unit = (int)(IMAGE_ALIGNMENT / elementSize);
+
+    return (width + unit - 1) / unit * unit;
+}
+
+/*======================================================================
+ * 画像構造体の初期化
+ *======================================================================
+ * 画像構造体 image_t *ptImage の画素数(width × height)、階調数
+ * (maxValue)を設定し、画素値データを格納するのに必要なメモリ領域を確
+ * 保する。確保できない時は data を NULL にして -1 を返す。
+ */
+int tryInitImage(image_t *ptImage, int width, int height, int maxValue)
+{
+    ptImage->width = width;
+    ptImage->height = height;
+    ptImage->maxValue = maxValue;
+    ptImage->stride = getAlignedStride(width, sizeof(unsigned char));
+    ptImage->mapAddress = NULL;
+    ptImage->mapLength = 0;
+    ptImage->loadedLength = 0;
+    ptImage->capacity = (size_t)ptImage->stride * (size_t)height;
+
+    /* メモリ領域の確保(各行の先頭を境界に合わせる) */
+    ptImage->data = (unsigned char *)tryAlignedMalloc(sizeof(unsigned char) * ptImage->capacity);
+    if (ptImage->data == NULL)
+    {
+        ptImage->capacity = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ *   tryInitImage() と同じだが、確保できない時はエラーとして終了する。
+ */
+void initImage(image_t *ptImage, int width, int height, int maxValue)
+{
+    if (tryInitImage(ptImage, width, height, maxValue) != 0)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 画像構造体の再初期化
+ *======================================================================
+ *   画像構造体 image_t *ptImage を、画素数(width × height)、階調数
+ * (maxValue)の画像に使い回す。まだ領域がないか、足りない時だけ確保し
+ * 直す。初めて使う時は、data と mapAddress を NULL、capacity を 0 に
+ * しておく。確保できない時は data を NULL にして -1 を返す。
+ */
+int tryReuseImage(image_t *ptImage, int width, int height, int maxValue)
+{
+    int stride = getAlignedStride(width, sizeof(unsigned char));
+    size_t size = (size_t)stride * (size_t)height;
+
+    ptImage->width = width;
+    ptImage->height = height;
+    ptImage->maxValue = maxValue;
+    ptImage->stride = stride;
+    ptImage->loadedLength = 0;
+
+    if (ptImage->data == NULL || size > ptImage->capacity)
+    {
+        alignedFree(ptImage->data);
+        ptImage->data = (unsigned char *)tryAlignedMalloc(sizeof(unsigned char) * size);
+        ptImage->capacity = ptImage->data != NULL ? size : 0;
+        if (ptImage->data == NULL)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ *   tryReuseImage() と同じだが、確保できない時はエラーとして終了する。
+ */
+void reuseImage(image_t *ptImage, int width, int height, int maxValue)
+{
+    if (tryReuseImage(ptImage, width, height, maxValue) != 0)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 画像構造体の解放
+ *======================================================================
+ *   画素値データの領域が alignedMalloc() で確保したものならば解放し、
+ * ファイルを割り当てたものならば割り当てを解除する。
+ */
+void freeImage(image_t *ptImage)
+{
+#ifndef _WIN32
+    if (ptImage->mapAddress != NULL)
+    {
+        munmap(ptImage->mapAddress, ptImage->mapLength);
+    }
+    else
+#endif
+    {
+        alignedFree(ptImage->data);
+    }
+
+    ptImage->data = NULL;
+    ptImage->mapAddress = NULL;
+    ptImage->mapLength = 0;
+    ptImage->loadedLength = 0;
+    ptImage->capacity = 0;
+
+    return;
+}
+
+/*======================================================================
+ * 画像の一部分を指す画像構造体
+ *======================================================================
+ *   画像構造体 image_t *ptView を、image_t *ptImage の (x, y) を左上と
+ * する width × height の部分を指すようにする。画素値データはコピーせ
+ * ず、行の間隔は ptImage と同じにする。ptView は freeImage() しない。
+ */
+void viewImageRegion(image_t *ptView, image_t *ptImage, int x, int y, int width, int height)
+{
+    ptView->width = width;
+    ptView->height = height;
+    ptView->maxValue = ptImage->maxValue;
+    ptView->data = ptImage->data + (size_t)ptImage->stride * y + x;
+    ptView->stride = ptImage->stride;
+    ptView->mapAddress = NULL;
+    ptView->mapLength = 0;
+    ptView->loadedLength = (size_t)width * (size_t)height;
+    ptView->capacity = 0;
+
+    return;
+}
+
+/*======================================================================
+ * 画素値データのコピー
+ *======================================================================
+ *   同じ大きさの画像 image_t *source の画素値データを、行ごとに
+ * image_t *destination にコピーする。行の間隔は違っていてもよい。
+ */
+void copyImageData(image_t *destination, image_t *source)
+{
+    for (int y = 0; y < source->height; y++)
+    {
+        memcpy(destination->data + (size_t)destination->stride * y,
+               source->data + (size_t)source->stride * y, source->width);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * PGM-RAW フォーマットのヘッダ部分の解析
+ *======================================================================
+ *   メモリ上の領域 const unsigned char *buf (length バイト)の先頭にあ
+ * る PGM-RAW フォーマットのヘッダ部分を1回の走査で解析し、画素数、階
+ * 調数と、画素値データの先頭の位置(buf の先頭からのバイト数)を返す。
+ *   Netpbm の定義(pgm(5))に従い、
+ *     "P5" 空白 幅 空白 高さ 空白 最大画素値 空白1文字 画素値データ
+ * の形式を受け付ける。空白は SP, TAB, CR, LF のいずれかで、何個続い
+ * てもよく、幅、高さ、最大画素値が同じ行にあっても別の行にあってもよい。
+ *   '#' から次の CR または LF までは注釈で、行の途中にあってもよく、
+ * その CR または LF の1文字の空白として扱う。したがって、最大画素値の
+ * 直後に注釈がある時は、その注釈の終わりの改行の次から画素値データが
+ * 始まり、最大画素値の後に空白がある時は、その空白の次から始まる。
+ *   解析できた時は 1 を、ヘッダが途中で終わっている時は 0 を、形式が
+ * 正しくない時は -1 を返す。
+ *   最大画素値が 256 以上(1画素2バイト)の画像には対応していない。
+ */
+#define isPgmSpace(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+int parsePgmRawHeader(const unsigned char *buf, size_t length,
+                      int *width, int *height, int *maxValue, size_t *offset)
+{
+    int values[3];
+    size_t pos = 2;
+
+    /* マジックナンバー(P5) の確認 */
+    if (length < 2)
+    {
+        return 0;
+    }
+    if (buf[0] != 'P' || buf[1] != '5')
+    {
+        return -1;
+    }
+
+    /* 幅、高さ、最大画素値の読み込み */
+    for (int n = 0; n < 3; n++)
+    {
+        int separated = 0;
+        long long value = 0;
+
+        /* 空白と注釈の読み飛ばし */
+        for (;;)
+        {
+            if (pos >= length)
+            {
+                return 0;
+            }
+            if (buf[pos] == '#')
+            {
+                while (pos < length && buf[pos] != '\r' && buf[pos] != '\n')
+                {
+                    pos++;
+                }
+                if (pos >= length)
+                {
+                    return 0;
+                }
+            }
+            else if (!isPgmSpace(buf[pos]))
+            {
+                break;
+            }
+            pos++;
+            separated = 1;
+        }
+
+        /* 空白で区切られた10進数でなければエラー */
+        if (!separated || buf[pos] < '0' || buf[pos] > '9')
+        {
+            return -1;
+        }
+        while (pos < length && buf[pos] >= '0' && buf[pos] <= '9')
+        {
+            value = value * 10 + (buf[pos] - '0');
+            if (value > 0x7fffffff)
+            {
+                return -1;
+            }
+            pos++;
+        }
+        if (pos >= length)
+        {
+            return 0;
+        }
+        values[n] = (int)value;
+    }
+
+    /* 最大画素値の後の空白1文字(注釈ならその終わりの改行まで) */
+    if (buf[pos] == '#')
+    {
+        while (pos < length && buf[pos] != '\r' && buf[pos] != '\n')
+        {
+            pos++;
+        }
+        if (pos >= length)
+        {
+            return 0;
+        }
+    }
+    else if (!isPgmSpace(buf[pos]))
+    {
+        return -1;
+    }
+    pos++;
+
+    /* 値の範囲の確認 */
+    if (values[0] <= 0 || values[1] <= 0 || values[0] > 0x7fffffff / values[1])
+    {
+        return -1;
+    }
+    if (values[2] <= 0 || values[2] >= 256)
+    {
+        return -1;
+    }
+
+    *width = values[0];
+    *height = values[1];
+    *maxValue = values[2];
+    *offset = pos;
+
+    return 1;
+}
+
+/*
+ * 読み込み開始時刻(最初の画素を参照できるまでの時間の計測用)
+ */
+static __thread double pgmReadStartTime;
+
+/*
+ * ヘッダ部分を読み込む時に一度に読み込むバイト数
+ */
+#define PGM_HEADER_CHUNK 4096
+
+/*======================================================================
+ * PGM-RAW フォーマットのヘッダ部分の少しずつの読み込み
+ *======================================================================
+ *   FILE *fp から PGM_HEADER_CHUNK バイトずつ読み込みながら
+ * parsePgmRawHeader() で解析し、画素数、階調数と画素値データの先頭の
+ * 位置 *offset を返す。読み込んだ内容(ヘッダの後に画素値データの先頭
+ * 部分を含むことがある)を malloc した領域で返し、その大きさを *length
+ * にセットする。返した領域は呼び出し元で free する。
+ *   解析できない時は NULL を返す。
+ */
+unsigned char *tryReadPgmRawHeaderChunks(FILE *fp, int *width, int *height, int *maxValue,
+                                         size_t *offset, size_t *length)
+{
+    unsigned char *buf = NULL;
+    size_t capacity = 0;
+    int result = 0;
+
+    *length = 0;
+    while (result == 0)
+    {
+        if (*length == capacity)
+        {
+            capacity += PGM_HEADER_CHUNK;
+            buf = (unsigned char *)realloc(buf, capacity);
+            if (buf == NULL)
+            {
+                fputs("out of memory\n", stderr);
+                exit(1);
+            }
+        }
+
+        size_t n = fread(buf + *length, sizeof(unsigned char), capacity - *length, fp);
+        if (n == 0)
+        {
+            break;
+        }
+        *length += n;
+
+        result = parsePgmRawHeader(buf, *length, width, height, maxValue, offset);
+    }
+    if (result != 1)
+    {
+        free(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+/*
+ *   tryReadPgmRawHeaderChunks() と同じだが、解析できない時はエラーとし
+ * て終了する。
+ */
+unsigned char *readPgmRawHeaderChunks(FILE *fp, int *width, int *height, int *maxValue,
+                                      size_t *offset, size_t *length)
+{
+    unsigned char *buf = tryReadPgmRawHeaderChunks(fp, width, height, maxValue, offset, length);
+
+    if (buf == NULL)
+    {
+        fputs("Reading PGM-RAW header was failed\n", stderr);
+        exit(1);
+    }
+
+    return buf;
+}
+
+/*======================================================================
+ * PGM-RAW フォーマットのヘッダ部分の読み込み
+ *======================================================================
+ *   PGM-RAW フォーマットの画像データファイル FILE *fp から、ヘッダ部
+ * 分を読み込んで、その画像の画素数、階調数を調べ、画像構造体
+ * image_t *ptImage に設定する。ヘッダ部分の解析は
+ * parsePgmRawHeader() で、ファイルの内容を置いたメモリ上で行う。
+ *   通常のファイルの時は、ファイル全体を読み込み専用でメモリに割り当
+ * て、その上でヘッダ部分を解析して、data メンバーが割り当てた領域の中
+ * の画素値データの先頭を直接指すようにする。画素値データはコピーせず、
+ * 参照した時にページキャッシュから読み込まれる。入力画像には書き込ま
+ * ないので、書き込むと SIGSEGV で止まる。
+ * 先頭から順に読むことを madvise で知らせておく。
+ *   割り当てができない時(パイプからの入力、mmap がない環境など)は、
+ * PGM_HEADER_CHUNK バイトずつ読み込みながら解析し、総画素数分の領域
+ * を確保して、一緒に読み込んだ画素値データの先頭部分をコピーしておく。
+ * 残りは readPgmRawBitmapData() で読み込む。
+ *   読み込めない時は、確保した領域を解放して、理由を message に入れて
+ * -1 を返す。
+ */
+int tryReadPgmRawHeader(FILE *fp, image_t *ptImage, const char **message)
+{
+    int width, height, maxValue;
+    size_t offset;
+
+    stage_timer_t timer;
+
+    beginStage(&timer);
+    pgmReadStartTime = getTime();
+
+    ptImage->data = NULL;
+    ptImage->mapAddress = NULL;
+    ptImage->mapLength = 0;
+    ptImage->loadedLength = 0;
+    ptImage->capacity = 0;
+
+#ifndef _WIN32
+    /* ファイル全体のメモリへの割り当て */
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *address = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (address != MAP_FAILED)
+        {
+            madvise(address, (size_t)st.st_size, MADV_SEQUENTIAL);
+            madvise(address, (size_t)st.st_size, MADV_WILLNEED);
+
+            if (parsePgmRawHeader((unsigned char *)address, (size_t)st.st_size,
+                                  &width, &height, &maxValue, &offset) != 1)
+            {
+                munmap(address, (size_t)st.st_size);
+                *message = "Reading PGM-RAW header was failed";
+                return -1;
+            }
+
+            /* 画素値データが足りない時はエラー */
+            if ((size_t)st.st_size - offset < (size_t)width * (size_t)height)
+            {
+                munmap(address, (size_t)st.st_size);
+                *message = "Reading PGM-RAW bitmap data was failed";
+                return -1;
+            }
+
+            ptImage->width = width;
+            ptImage->height = height;
+            ptImage->maxValue = maxValue;
+            ptImage->data = (unsigned char *)address + offset;
+            ptImage->stride = width;
+            ptImage->mapAddress = address;
+            ptImage->mapLength = (size_t)st.st_size;
+
+            endStage(&timer, "read_header", offset, 0);
+            return 0;
+        }
+    }
+#endif
+
+    /* 解析できるまで少しずつ読み込む */
+    size_t length;
+    unsigned char *buf = tryReadPgmRawHeaderChunks(fp, &width, &height, &maxValue, &offset, &length);
+    if (buf == NULL)
+    {
+        *message = "Reading PGM-RAW header was failed";
+        return -1;
+    }
+
+    /* 画像構造体の初期化 */
+    if (tryInitImage(ptImage, width, height, maxValue) != 0)
+    {
+        free(buf);
+        *message = "out of memory";
+        return -1;
+    }
+
+    /* 一緒に読み込んだ画素値データのコピー(行の途中で終わることがある) */
+    size_t loaded = length - offset;
+    if (loaded > (size_t)width * (size_t)height)
+    {
+        loaded = (size_t)width * (size_t)height;
+    }
+    for (size_t i = 0; i < loaded; i += (size_t)width)
+    {
+        size_t n = loaded - i < (size_t)width ? loaded - i : (size_t)width;
+        memcpy(ptImage->data + (size_t)ptImage->stride * (i / width), buf + offset + i, n);
+    }
+    ptImage->loadedLength = loaded;
+    free(buf);
+
+    endStage(&timer, "read_header", length, 0);
+    return 0;
+}
+
+/*
+ *   tryReadPgmRawHeader() と同じだが、読み込めない時はエラーとして終了
+ * する。
+ */
+void readPgmRawHeader(FILE *fp, image_t *ptImage)
+{
+    const char *message;
+
+    if (tryReadPgmRawHeader(fp, ptImage, &message) != 0)
+    {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * PGM-RAWフォーマットの画素値データの読み込み
+ *======================================================================
+ *   入力ファイル FILE *fp の画素値データを、画像構造体
+ * image_t *ptImage の data メンバーから参照できるようにする。
+ *   readPgmRawHeader() でファイルをメモリに割り当てた時は、読み込む
+ * ものはない。そうでない時は、ヘッダと一緒に読み込んだ分の続きから、
+ * 総画素数分の画素値データを読み込む。
+ *   読み込み開始から最初の画素を参照できるまでの時間を表示する。
+ *   画素値データが足りない時は、理由を message に入れて -1 を返す(領
+ * 域は解放しないので、呼び出し元で freeImage() する)。
+ */
+int tryReadPgmRawBitmapData(FILE *fp, image_t *ptImage, const char **message)
+{
+    size_t size = (size_t)ptImage->width * (size_t)ptImage->height;
+    size_t rest = 0;
+    stage_timer_t timer;
+
+    beginStage(&timer);
+
+    if (ptImage->mapAddress == NULL)
+    {
+        size_t width = (size_t)ptImage->width;
+        size_t stride = (size_t)ptImage->stride;
+
+        rest = size - ptImage->loadedLength;
+
+        /* 行の間隔が幅と違う時は、行の残りずつ読み込む */
+        while (ptImage->loadedLength < size)
+        {
+            size_t loaded = ptImage->loadedLength;
+            size_t n = stride == width ? size - loaded : width - loaded % width;
+
+            if (fread(ptImage->data + stride * (loaded / width) + loaded % width, sizeof(unsigned char), n, fp) != n)
+            {
+                /* エラー */
+                *message = "Reading PGM-RAW bitmap data was failed";
+                return -1;
+            }
+            ptImage->loadedLength = loaded + n;
+        }
+    }
+
+    /* 最初の画素の参照 */
+    volatile unsigned char firstPixel = ptImage->data[0];
+    (void)firstPixel;
+
+    printDiagnostic("read: mode=%s, first_pixel_latency=%.3f ms\n",
+           ptImage->mapAddress != NULL ? "mmap" : "fread", (getTime() - pgmReadStartTime) * 1000.0);
+
+    /* ファイルを割り当てた時は、画素値データは参照した時に読み込まれる */
+    endStage(&timer, "read_bitmap", rest, size);
+    return 0;
+}
+
+/*
+ *   tryReadPgmRawBitmapData() と同じだが、画素値データが足りない時はエ
+ * ラーとして終了する。
+ */
+void readPgmRawBitmapData(FILE *fp, image_t *ptImage)
+{
+    const char *message;
+
+    if (tryReadPgmRawBitmapData(fp, ptImage, &message) != 0)
+    {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * PGM-RAW フォーマットのヘッダ部分の書き込み
+ *======================================================================
+ *   画像構造体 image_t *ptImage の内容に従って、出力ファイル FILE *fp
+ * に、PGM-RAW フォーマットのヘッダ部分を書き込む。
+ */
+void writePgmRawHeader(FILE *fp, image_t *ptImage)
+{
+    stage_timer_t timer;
+    int length, written = 0;
+
+    beginStage(&timer);
+
+    /* マジックナンバー(P5) の書き込み */
+    if (fputs("P5\n", fp) == EOF)
+    {
+        goto error;
+    }
+    written += 3;
+
+    /* 画像サイズの書き込み */
+    if ((length = fprintf(fp, "%d %d\n", ptImage->width, ptImage->height)) < 0)
+    {
+        goto error;
+    }
+    written += length;
+
+    /* 画素値の最大値を書き込む */
+    if ((length = fprintf(fp, "%d\n", ptImage->maxValue)) < 0)
+    {
+        goto error;
+    }
+    written += length;
+
+    endStage(&timer, "write_header", (size_t)written, 0);
+    return;
+
+error:
+    fputs("Writing PGM-RAW header was failed\n", stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * PGM-RAWフォーマットの画素値データの書き込み
+ *======================================================================
+ *   画像構造体 image_t *ptImage の内容に従って、出力ファイル FILE *fp
+ * に、PGM-RAW フォーマットの画素値データを書き込む
+ */
+void writePgmRawBitmapData(FILE *fp, image_t *ptImage)
+{
+    size_t size = (size_t)ptImage->width * (size_t)ptImage->height;
+    stage_timer_t timer;
+
+    beginStage(&timer);
+
+    /* 行の間隔が幅と同じ時はまとめて、違う時は1行ずつ書き込む */
+    int rows = ptImage->stride == ptImage->width ? 1 : ptImage->height;
+    size_t length = rows == 1 ? size : (size_t)ptImage->width;
+    for (int y = 0; y < rows; y++)
+    {
+        if (fwrite(ptImage->data + (size_t)ptImage->stride * y, sizeof(unsigned char), length, fp) != length)
+        {
+            /* エラー */
+            fputs("Writing PGM-RAW bitmap data was failed\n", stderr);
+            exit(1);
+        }
+    }
+
+    endStage(&timer, "write_bitmap", size, size);
+}
+
+#endif /* PGM_H */
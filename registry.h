@@ -0,0 +1,100 @@
+/*
+ * フィルタの登録
+ *
+ *   名前で選べるフィルタの一覧。sample_1_*.c、sample_2.c の処理を1つ
+ * のプログラム(sample_filter.c)から名前で呼び出し、バッチ処理では画
+ * 像ごとに別のフィルタを使えるようにする。3x3 のフィルタは stencil.h
+ * の STENCIL_LIST から登録する。
+ */
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "stencil.h"
+#include "batch.h"
+#include "otsu.h"
+
+/*
+ * フィルタ構造体の定義
+ */
+typedef struct
+{
+    const char *name;        /* フィルタの名前 */
+    batch_process_t process; /* 1枚の画像を処理する関数 */
+    int stencil;             /* 3x3 のフィルタの種類(それ以外は -1) */
+    int output;              /* 3x3 のフィルタの値の変換方法 */
+} filter_entry_t;
+
+/*
+ * 3x3 のフィルタの1枚の画像を処理する関数
+ *   STENCIL_LIST の種類ごとに、filterStencilImage() に種類と変換方法を
+ * 渡す関数 filter_<種類> を生成する。
+ */
+#define STENCIL_FILTER_FUNCTION(kind, name, output)                         \
+    static void filter_##kind(image_t *resultImage, image_t *originalImage) \
+    {                                                                       \
+        filterStencilImage(resultImage, originalImage, kind, output);      \
+    }
+STENCIL_LIST(STENCIL_FILTER_FUNCTION)
+
+/*
+ * 登録されているフィルタ
+ */
+#define STENCIL_FILTER_ENTRY(kind, name, output) {name, filter_##kind, kind, output},
+static const filter_entry_t filterEntries[] = {
+    STENCIL_LIST(STENCIL_FILTER_ENTRY)
+    {"otsu", binarization, -1, 0},
+};
+#define FILTER_COUNT ((int)(sizeof(filterEntries) / sizeof(filterEntries[0])))
+
+/*======================================================================
+ * 名前からのフィルタの取得
+ *======================================================================
+ *   const char *name の名前で登録されているフィルタを返す。登録されて
+ * いない時は NULL を返す。
+ */
+const filter_entry_t *findFilter(const char *name)
+{
+    for (int i = 0; i < FILTER_COUNT; i++)
+    {
+        if (strcmp(name, filterEntries[i].name) == 0)
+        {
+            return &filterEntries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*======================================================================
+ * 名前からの1枚の画像を処理する関数の取得
+ *======================================================================
+ *   バッチ処理のリストファイルで、行ごとにフィルタを選ぶために使う。
+ */
+batch_process_t lookupFilterProcess(const char *name)
+{
+    const filter_entry_t *filter = findFilter(name);
+
+    return filter != NULL ? filter->process : NULL;
+}
+
+/*======================================================================
+ * 登録されているフィルタの名前の表示
+ *======================================================================
+ */
+void printFilterNames(FILE *fp)
+{
+    for (int i = 0; i < FILTER_COUNT; i++)
+    {
+        fprintf(fp, "%s%s", i > 0 ? ", " : "", filterEntries[i].name);
+    }
+    fputc('\n', fp);
+
+    return;
+}
+
+#endif /* REGISTRY_H */
@@ -0,0 +1,239 @@
+/* server.h の memfd_create() と共有メモリの封印を使う */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "filter.h"
+#include "stencil.h"
+#include "stream.h"
+#include "batch.h"
+#include "registry.h"
+#include "multi.h"
+#include "server.h"
+
+/*======================================================================
+ * このプログラムの使い方の説明
+ *======================================================================
+ */
+void usage(char *program)
+{
+    fprintf(stderr, "usage : %s <filter> <input pgm file> <output pgm file>\n", program);
+    fprintf(stderr, "        %s <filter> --batch <input pgm file> <output pgm file> ...\n", program);
+    fprintf(stderr, "        %s <filter> --batch-dir <output directory> <input pgm file> ...\n", program);
+    fprintf(stderr, "        %s [<filter>] --manifest <manifest file>\n", program);
+    fprintf(stderr, "        %s --multi <input pgm file> <filter> <output pgm file> ...\n", program);
+    fprintf(stderr, "        %s --serve <socket>\n", program);
+    fprintf(stderr, "        %s --client <socket> <filter> <input pgm file> <output pgm file>\n", program);
+    fprintf(stderr, "        %s --client-shm <socket> <filter> <input pgm file> <output pgm file>\n", program);
+    fprintf(stderr, "filter: ");
+    printFilterNames(stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * 複数のフィルタの同時処理
+ *======================================================================
+ *   sample_filter --multi <入力> <フィルタ> <出力> [<フィルタ> <出力> ...]
+ *   入力画像を1回だけ読み込み、3x3 のフィルタは filterStencilMultiImage()
+ * で近傍を1回だけ読んで同時に計算して、それぞれの出力ファイルに書き込む。
+ * それ以外のフィルタ(otsu)は1つずつ処理する。
+ */
+int multiFilteringImage(int argc, char **argv)
+{
+    image_t originalImage;
+    image_t resultImageData[FILTER_COUNT];
+    image_t *stencilResultImages[STENCIL_COUNT] = {NULL};
+    FILE *outfps[FILTER_COUNT];
+    const filter_entry_t *filters[FILTER_COUNT];
+    int count = (argc - 3) / 2;
+
+    if (argc < 5 || (argc - 3) % 2 != 0 || count > FILTER_COUNT)
+    {
+        usage(argv[0]);
+    }
+
+    FILE *infp = fopen(argv[2], "rb");
+    if (infp == NULL)
+    {
+        fputs("Opening the input file was failend\n", stderr);
+        usage(argv[0]);
+    }
+
+    /* フィルタと出力ファイル */
+    for (int i = 0; i < count; i++)
+    {
+        filters[i] = findFilter(argv[3 + 2 * i]);
+        if (filters[i] == NULL)
+        {
+            fprintf(stderr, "unknown filter '%s'\n", argv[3 + 2 * i]);
+            usage(argv[0]);
+        }
+        for (int j = 0; j < i; j++)
+        {
+            if (filters[j] == filters[i])
+            {
+                fprintf(stderr, "filter '%s' is specified twice\n", filters[i]->name);
+                usage(argv[0]);
+            }
+        }
+        outfps[i] = fopen(argv[4 + 2 * i], "wb");
+        if (outfps[i] == NULL)
+        {
+            fputs("Opening the output file was failend\n", stderr);
+            usage(argv[0]);
+        }
+    }
+
+    /* 元画像の読み込み(1回だけ) */
+    readPgmRawHeader(infp, &originalImage);
+    readPgmRawBitmapData(infp, &originalImage);
+
+    for (int i = 0; i < count; i++)
+    {
+        initImage(&resultImageData[i], originalImage.width, originalImage.height, originalImage.maxValue);
+        if (filters[i]->stencil >= 0)
+        {
+            stencilResultImages[filters[i]->stencil] = &resultImageData[i];
+        }
+    }
+
+    /* 3x3 のフィルタ(同時に計算する) */
+    filterStencilMultiImage(&originalImage, stencilResultImages);
+
+    /* それ以外のフィルタと書き込み */
+    for (int i = 0; i < count; i++)
+    {
+        if (filters[i]->stencil < 0)
+        {
+            filters[i]->process(&resultImageData[i], &originalImage);
+        }
+        writePgmRawHeader(outfps[i], &resultImageData[i]);
+        writePgmRawBitmapData(outfps[i], &resultImageData[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * メイン
+ *   フィルタを名前で選び、sample_1_*.c、sample_2.c と同じ処理を行う。
+ * リストファイルでは、行の先頭にフィルタの名前を書くと、その行だけ別
+ * のフィルタを使う(フィルタを省略した時は、すべての行に書く)。
+ */
+int main(int argc, char **argv)
+{
+    image_t originalImage, resultImage;
+    FILE *infp, *outfp;
+
+    /* フィルタを省略したリストファイルによるバッチ処理 */
+    if (argc >= 2 && strcmp(argv[1], "--manifest") == 0)
+    {
+        return runBatch(argc, argv, NULL, lookupFilterProcess);
+    }
+
+    /* 複数のフィルタの同時処理 */
+    if (argc >= 2 && strcmp(argv[1], "--multi") == 0)
+    {
+        return multiFilteringImage(argc, argv);
+    }
+
+    /* Unix ドメインソケットで要求を受け付けるサーバ */
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0)
+    {
+        if (argc != 3)
+        {
+            usage(argv[0]);
+        }
+        return runServer(argv[2], lookupFilterProcess);
+    }
+
+    /* サーバへの要求 */
+    if (argc >= 2 && (strcmp(argv[1], "--client") == 0 || strcmp(argv[1], "--client-shm") == 0))
+    {
+        if (argc != 6 || findFilter(argv[3]) == NULL)
+        {
+            usage(argv[0]);
+        }
+        infp = fopen(argv[4], "rb");
+        if (infp == NULL)
+        {
+            fputs("Opening the input file was failend\n", stderr);
+            usage(argv[0]);
+        }
+        outfp = fopen(argv[5], "wb");
+        if (outfp == NULL)
+        {
+            fputs("Opening the output file was failend\n", stderr);
+            usage(argv[0]);
+        }
+        long microseconds = strcmp(argv[1], "--client-shm") == 0 ? requestServerShared(argv[2], argv[3], infp, outfp)
+                                                                 : requestServer(argv[2], argv[3], infp, outfp);
+        printf("client: %s, server=%ld us\n", argv[3], microseconds);
+        return 0;
+    }
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+    }
+    const filter_entry_t *filter = findFilter(argv[1]);
+    if (filter == NULL)
+    {
+        fprintf(stderr, "unknown filter '%s'\n", argv[1]);
+        usage(argv[0]);
+    }
+
+    /* フィルタの名前を除いた引数(argv[0] はプログラム名のまま) */
+    argv[1] = argv[0];
+    argc--;
+    argv++;
+
+    /* 複数の画像のバッチ処理 */
+    if (isBatchArg(argc, argv))
+    {
+        return runBatch(argc, argv, filter->process, lookupFilterProcess);
+    }
+
+    /* 引数の解析 */
+    if (argc != 3)
+    {
+        usage(argv[0]);
+    }
+    parseArg(argc, argv, &infp, &outfp);
+
+    /* 3x3 のフィルタは、画像全体をメモリに置かず、行ごとに読み込み、 */
+    /* 計算し、書き込むこともできる */
+    if (filter->stencil >= 0 && getStreamMode())
+    {
+        streamFilteringImage(infp, outfp, filter->stencil, filter->output);
+        return 0;
+    }
+
+    /* 元画像の画像ファイルのヘッダ部分を読み込み、画像構造体を初期化 */
+    /* する */
+    readPgmRawHeader(infp, &originalImage);
+
+    /* 元画像の画像ファイルのビットマップデータを読み込む */
+    readPgmRawBitmapData(infp, &originalImage);
+
+    /* 結果画像の画像構造体を初期化する。画素数、階調数は元画像と同じ */
+    initImage(
+        &resultImage,
+        originalImage.width,
+        originalImage.height,
+        originalImage.maxValue);
+
+    /* フィルタリング */
+    filter->process(&resultImage, &originalImage);
+
+    /* 画像ファイルのヘッダ部分の書き込み */
+    writePgmRawHeader(outfp, &resultImage);
+
+    /* 画像ファイルのビットマップデータの書き込み */
+    writePgmRawBitmapData(outfp, &resultImage);
+
+    return 0;
+}
@@ -0,0 +1,1272 @@
+/*
+ * Unix ドメインソケットによるフィルタのサーバ
+ *
+ *   画像ごとにプロセスを起動してファイルを読み書きする代わりに、常駐
+ * したプロセスがソケットで要求を受け付け、同じ接続で結果を返す。ス
+ * レッドプール、tmpImage、接続ごとの受信領域と結果画像は使い回すので、
+ * 2回目以降の要求では起動や確保の時間がかからない。
+ *
+ *   要求: フィルタの名前の1行と、それに続く PGM-RAW の画像
+ *     <filter>\n
+ *     P5 <width> <height> <maxValue>\n<画素値データ>
+ *   応答: 成功した時は、処理時間(マイクロ秒)の1行と、結果の PGM-RAW の
+ *   画像。失敗した時は、理由の1行を返して接続を閉じる。
+ *     OK <microseconds>\n
+ *     P5 <width> <height> <maxValue>\n<画素値データ>
+ *     ERROR <message>\n
+ *   1つの接続で、要求と応答を何回でも続けられる。画素数が
+ * SERVER_MAX_PIXELS より大きい画像は ERROR を返す。
+ *   応答はソケットを待たせずに(O_NONBLOCK)送り、送り終えるまでその接
+ * 続の次の要求は処理しない。応答を読まない接続があっても、ほかの接続
+ * の処理は止まらない。
+ *
+ *   共有メモリ: 画像を送受信せずに、要求を送る側が作った共有メモリの
+ * 中の画像を処理して、結果も共有メモリに書き込む。共有メモリの先頭に
+ * は記述子の並び(shared_header_t)があり、記述子ごとに入力画像と結果
+ * 画像の位置と画素数を書いておく。まず共有メモリのファイル記述子を
+ * SCM_RIGHTS で "shm" の1行と一緒に送り、以後は記述子の番号を付けた
+ * フィルタの名前の1行を送る。記述子の数だけ、応答を待たずに続けて要
+ * 求を送れる。
+ *     shm\n                  (ファイル記述子を付ける) → OK 0\n
+ *     <filter> <slot>\n      → OK <microseconds>\n
+ *
+ *   信頼の範囲: ソケットに接続できるプロセス(ソケットのファイルの権限
+ * で決まる)は、サーバに任意の大きさの処理をさせられるが、サーバを止め
+ * たり、ほかの接続の画像を読み書きしたりはできないようにする。
+ *   ・要求の画像の画素数は SERVER_MAX_PIXELS までとし、受信領域、結果
+ *     画像や tmpImage を確保できない時は、ERROR を返してその接続だけを
+ *     閉じる。閉じた接続の受信領域と結果画像は解放する
+ *   ・共有メモリは要求を送る側も書き換えられるので、記述子は写してか
+ *     ら範囲を確かめ、画素値データは処理の途中で書き換えられてもよい
+ *     ものとして扱う(結果がおかしくなるのは、その要求だけ)
+ *   ・共有メモリを割り当てた後に縮められると、サーバが読み書きした時
+ *     に SIGBUS で止まるので、縮められないように封印された(memfd の
+ *     F_SEAL_SHRINK)ものだけを受け付ける。封印のない Linux 以外の環
+ *     境では、共有メモリは使えない
+ *   memfd_create() と封印を使うので、このヘッダを使うプログラムは、最
+ * 初に _GNU_SOURCE を定義しておく。
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "stencil.h"
+#include "batch.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/*
+ * 同時に受け付ける接続の数の上限
+ */
+#define SERVER_MAX_CONNECTIONS 64
+
+/*
+ * 要求の1行目(フィルタの名前)の長さの上限
+ */
+#define SERVER_MAX_LINE 256
+
+/*
+ * 一度に受信するバイト数
+ */
+#define SERVER_READ_CHUNK (64 * 1024)
+
+/*
+ * 1つの要求の画像の画素数の上限
+ */
+#define SERVER_MAX_PIXELS (256 * 1024 * 1024)
+
+/*
+ * 応答の1回の書き込みにまとめる行の数
+ */
+#define SERVER_WRITE_ROWS 64
+
+/*
+ * 共有メモリの記述子の数と、共有メモリの先頭の目印
+ */
+#define SHARED_SLOT_COUNT 16
+#define SHARED_MAGIC 0x314d4750u /* "PGM1" */
+
+/*
+ * 共有メモリの記述子の定義
+ *   位置は共有メモリの先頭からのバイト数。結果画像の画素数、階調数と
+ * 行の間隔は入力画像と同じ。
+ */
+typedef struct
+{
+    int width;                        /* 入力画像の横方向の画素数 */
+    int height;                       /* 入力画像の縦方向の画素数 */
+    int maxValue;                     /* 入力画像の階調数 */
+    int stride;                       /* 行の間隔の画素数(0 は width と同じ) */
+    unsigned long long inputOffset;   /* 入力画像の画素値データの位置 */
+    unsigned long long outputOffset;  /* 結果画像の画素値データの位置 */
+} shared_slot_t;
+
+/*
+ * 共有メモリの先頭の構造体の定義
+ */
+typedef struct
+{
+    unsigned magic;                         /* SHARED_MAGIC */
+    unsigned slotCount;                     /* SHARED_SLOT_COUNT */
+    unsigned long long size;                /* 共有メモリのバイト数 */
+    shared_slot_t slots[SHARED_SLOT_COUNT]; /* 記述子の並び */
+} shared_header_t;
+
+/*
+ * 接続構造体の定義
+ */
+typedef struct
+{
+    int fd;                 /* ソケット(使っていない時は -1) */
+    unsigned char *buffer;  /* 受信したバイト列 */
+    size_t length;          /* 受信したバイト数 */
+    size_t capacity;        /* buffer の領域のバイト数 */
+    image_t resultImage;    /* 結果画像(接続の間、使い回す) */
+    char reply[96];         /* 応答の1行目(と結果画像のヘッダ部分) */
+    size_t replyLength;     /* reply のバイト数 */
+    image_t *replyImage;    /* 応答で送る画像(ない時は NULL) */
+    size_t replySize;       /* 応答全体のバイト数(送信中でない時は 0) */
+    size_t replySent;       /* 応答の送信したバイト数 */
+    char replyLog[384];     /* 応答を送り終えた時の表示 */
+    double replyStart;      /* 要求の処理を始めた時刻 */
+    int pendingFd;          /* 受け取った共有メモリのファイル記述子 */
+                            /* ("shm" の要求の前、ない時は -1) */
+    unsigned char *shared;  /* 割り当てた共有メモリ(ない時は NULL) */
+    size_t sharedLength;    /* 共有メモリのバイト数(先頭の構造体の size) */
+    size_t mapLength;       /* 割り当てたバイト数(munmap に渡す) */
+} server_connection_t;
+
+/*
+ * 終了の要求(SIGINT, SIGTERM)
+ */
+static volatile sig_atomic_t serverStopRequested = 0;
+
+static void requestServerStop(int signal)
+{
+    (void)signal;
+    serverStopRequested = 1;
+}
+
+/*======================================================================
+ * ソケットへの書き込み
+ *======================================================================
+ *   const void *data の length バイトをすべて書き込む。書き込めなかっ
+ * た時は -1 を返す。
+ */
+int writeSocket(int fd, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (length > 0)
+    {
+        ssize_t written = write(fd, p, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        length -= (size_t)written;
+    }
+
+    return 0;
+}
+
+/*======================================================================
+ * ソケットへの画素値データの書き込み
+ *======================================================================
+ *   画像 image_t *ptImage の画素値データを、行の間を詰めて書き込む。
+ * 書き込めなかった時は -1 を返す。
+ */
+int writeSocketImage(int fd, image_t *ptImage)
+{
+    if (ptImage->stride == ptImage->width)
+    {
+        return writeSocket(fd, ptImage->data, (size_t)ptImage->width * (size_t)ptImage->height);
+    }
+    for (int y = 0; y < ptImage->height; y++)
+    {
+        if (writeSocket(fd, ptImage->data + (size_t)ptImage->stride * y, (size_t)ptImage->width) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*======================================================================
+ * 接続の受信領域の確保
+ *======================================================================
+ *   受信領域を size バイト以上にする。確保できない時は -1 を返す(サー
+ * バはほかの接続のために動き続ける)。
+ */
+static int reserveConnectionBuffer(server_connection_t *connection, size_t size)
+{
+    if (size <= connection->capacity)
+    {
+        return 0;
+    }
+
+    size_t capacity = connection->capacity > 0 ? connection->capacity : SERVER_READ_CHUNK;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+
+    unsigned char *buffer = (unsigned char *)realloc(connection->buffer, capacity);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    connection->buffer = buffer;
+    connection->capacity = capacity;
+
+    return 0;
+}
+
+/*======================================================================
+ * 応答の送信
+ *======================================================================
+ *   送信中の応答の残りを、ソケットが受け付けるだけ書き込む。画像の画素
+ * 値データは行の間を詰めて、SERVER_WRITE_ROWS 行ずつ writev() で書き
+ * 込む。送り終えたら replyLog を表示する。書き込めなかった時は -1 を
+ * 返す(ソケットがいっぱいの時は 0 を返し、続きは POLLOUT の後に送る)。
+ */
+static int flushReply(server_connection_t *connection)
+{
+    while (connection->replySent < connection->replySize)
+    {
+        struct iovec iov[SERVER_WRITE_ROWS + 1];
+        int count = 0;
+        size_t position = connection->replySent;
+
+        if (position < connection->replyLength)
+        {
+            iov[count].iov_base = connection->reply + position;
+            iov[count].iov_len = connection->replyLength - position;
+            count++;
+            position = connection->replyLength;
+        }
+
+        image_t *image = connection->replyImage;
+        if (image != NULL && position < connection->replySize)
+        {
+            // 行の間隔が幅と同じ時は、画像全体を1行として送る
+            size_t rows = image->stride == image->width ? 1 : (size_t)image->height;
+            size_t rowLength = connection->replySize - connection->replyLength;
+            if (rows > 1)
+            {
+                rowLength = (size_t)image->width;
+            }
+
+            size_t pixel = position - connection->replyLength;
+            for (size_t y = pixel / rowLength, x = pixel % rowLength; y < rows && count <= SERVER_WRITE_ROWS; y++, x = 0)
+            {
+                iov[count].iov_base = image->data + (size_t)image->stride * y + x;
+                iov[count].iov_len = rowLength - x;
+                count++;
+            }
+        }
+
+        ssize_t written = writev(connection->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        connection->replySent += (size_t)written;
+    }
+
+    if (connection->replySize > 0 && connection->replyLog[0] != '\0')
+    {
+        printf("%s, total=%.3f ms\n", connection->replyLog, (getTime() - connection->replyStart) * 1000.0);
+        fflush(stdout);
+    }
+    connection->replySize = 0;
+    connection->replySent = 0;
+    connection->replyImage = NULL;
+    connection->replyLog[0] = '\0';
+
+    return 0;
+}
+
+/*======================================================================
+ * 応答の開始
+ *======================================================================
+ *   const char *text の length バイトと、画像 image_t *image(ない時は
+ * NULL)の画素値データを応答として送り始める。書き込めなかった時は -1
+ * を返す。
+ */
+static int sendReply(server_connection_t *connection, const char *text, size_t length, image_t *image)
+{
+    memcpy(connection->reply, text, length);
+    connection->replyLength = length;
+    connection->replyImage = image;
+    connection->replySize = length;
+    connection->replySent = 0;
+    if (image != NULL)
+    {
+        connection->replySize += (size_t)image->width * (size_t)image->height;
+    }
+
+    return flushReply(connection);
+}
+
+/*======================================================================
+ * 接続を閉じる
+ *======================================================================
+ *   受信領域と結果画像は、次の接続に持ち越さずに解放する。
+ */
+static void closeConnection(server_connection_t *connection)
+{
+    close(connection->fd);
+    connection->fd = -1;
+    free(connection->buffer);
+    connection->buffer = NULL;
+    connection->length = 0;
+    connection->capacity = 0;
+    freeImage(&connection->resultImage);
+    connection->replySize = 0;
+    connection->replySent = 0;
+    connection->replyImage = NULL;
+    connection->replyLog[0] = '\0';
+
+    if (connection->pendingFd >= 0)
+    {
+        close(connection->pendingFd);
+        connection->pendingFd = -1;
+    }
+    if (connection->shared != NULL)
+    {
+        munmap(connection->shared, connection->mapLength);
+        connection->shared = NULL;
+        connection->sharedLength = 0;
+        connection->mapLength = 0;
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 共有メモリの中の画像
+ *======================================================================
+ *   画像構造体 image_t *ptImage を、共有メモリ unsigned char *shared の
+ * offset バイト目からの、行の間隔 stride の画素値データを指すようにす
+ * る。data は共有メモリの中を指したままにし、freeImage() はしない。
+ */
+void viewSharedImage(image_t *ptImage, unsigned char *shared, unsigned long long offset,
+                     int width, int height, int maxValue, int stride)
+{
+    ptImage->width = width;
+    ptImage->height = height;
+    ptImage->maxValue = maxValue;
+    ptImage->data = shared + offset;
+    ptImage->stride = stride;
+    ptImage->mapAddress = NULL;
+    ptImage->mapLength = 0;
+    ptImage->loadedLength = (size_t)width * (size_t)height;
+    ptImage->capacity = 0;
+
+    return;
+}
+
+/*======================================================================
+ * ソケットからの受信
+ *======================================================================
+ *   受信領域の空いている所に受信する。ファイル記述子(SCM_RIGHTS)が付
+ * いていれば、pendingFd に残しておく。受信したバイト数を返す。
+ */
+static ssize_t receiveSocket(server_connection_t *connection)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr message;
+
+    iov.iov_base = connection->buffer + connection->length;
+    iov.iov_len = connection->capacity - connection->length;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(connection->fd, &message, 0);
+    if (received <= 0)
+    {
+        return received;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            if (connection->pendingFd >= 0)
+            {
+                close(connection->pendingFd);
+            }
+            memcpy(&connection->pendingFd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return received;
+}
+
+/*======================================================================
+ * 共有メモリの割り当て
+ *======================================================================
+ *   受け取ったファイル記述子の共有メモリを割り当てる(前の共有メモリ
+ * は解除する)。縮められないように封印されていない時や、正しくない時
+ * は、理由を message に入れて -1 を返す。
+ */
+static int attachSharedSegment(server_connection_t *connection, const char **message)
+{
+    struct stat st;
+    int fd = connection->pendingFd;
+
+    if (fd < 0)
+    {
+        *message = "no shared memory descriptor";
+        return -1;
+    }
+    connection->pendingFd = -1;
+
+    if (connection->shared != NULL)
+    {
+        munmap(connection->shared, connection->mapLength);
+        connection->shared = NULL;
+        connection->sharedLength = 0;
+        connection->mapLength = 0;
+    }
+
+#ifdef F_SEAL_SHRINK
+    /* 割り当てた後に縮められて SIGBUS にならないように、封印を確かめる */
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK))
+    {
+        close(fd);
+        *message = "shared memory not sealed against shrinking";
+        return -1;
+    }
+#else
+    close(fd);
+    *message = "shared memory not supported";
+    return -1;
+#endif
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(shared_header_t))
+    {
+        close(fd);
+        *message = "shared memory too small";
+        return -1;
+    }
+
+    /* 処理の途中でページフォールトが起きないように、割り当ての時に */
+    /* ページを用意しておく */
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void *address = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        *message = "mapping shared memory failed";
+        return -1;
+    }
+
+    const shared_header_t *header = (const shared_header_t *)address;
+    if (header->magic != SHARED_MAGIC || header->slotCount != SHARED_SLOT_COUNT ||
+        header->size > (unsigned long long)st.st_size)
+    {
+        munmap(address, (size_t)st.st_size);
+        *message = "invalid shared memory header";
+        return -1;
+    }
+
+    connection->shared = (unsigned char *)address;
+    connection->sharedLength = (size_t)header->size;
+    connection->mapLength = (size_t)st.st_size;
+
+    return 0;
+}
+
+/*======================================================================
+ * 共有メモリの画像の範囲の確認
+ *======================================================================
+ *   offset バイト目からの size バイトが、共有メモリの先頭の構造体の後
+ * ろにあって、共有メモリからはみ出していなければ 1 を返す。
+ */
+static int isSharedRangeValid(const server_connection_t *connection, unsigned long long offset, size_t size)
+{
+    return offset >= sizeof(shared_header_t) && offset <= connection->sharedLength &&
+           size <= connection->sharedLength - offset;
+}
+
+/*======================================================================
+ * 共有メモリの画像の処理
+ *======================================================================
+ *   記述子 slot の入力画像を process で処理して、結果を共有メモリの結
+ * 果画像の位置に直接書き込み、処理時間の応答を送り始める。要求が正し
+ * くない時は、理由を message に入れて -1 を返す。応答を書き込めなかっ
+ * た時は、message は NULL のまま -1 を返す。
+ */
+static int serveSharedRequest(server_connection_t *connection, batch_process_t process,
+                              const char *name, const char *slotText, int *served, const char **message)
+{
+    char *end;
+    long slot = strtol(slotText, &end, 10);
+
+    if (connection->shared == NULL)
+    {
+        *message = "no shared memory";
+        return -1;
+    }
+    if (*slotText == '\0' || *end != '\0' || slot < 0 || slot >= SHARED_SLOT_COUNT)
+    {
+        *message = "invalid slot";
+        return -1;
+    }
+
+    /* 要求を送る側が書き換えても影響しないように、記述子を写してから確かめる */
+    shared_slot_t descriptor;
+    memcpy(&descriptor, &((shared_header_t *)connection->shared)->slots[slot], sizeof(descriptor));
+    if (descriptor.stride == 0)
+    {
+        descriptor.stride = descriptor.width;
+    }
+
+    /* 最後の行の終わりまでのバイト数 */
+    size_t size = (size_t)descriptor.stride * (size_t)(descriptor.height - 1) + (size_t)descriptor.width;
+    if (descriptor.width < 1 || descriptor.height < 1 || descriptor.stride < descriptor.width ||
+        descriptor.maxValue < 1 || descriptor.maxValue > 255 ||
+        !isSharedRangeValid(connection, descriptor.inputOffset, size) ||
+        !isSharedRangeValid(connection, descriptor.outputOffset, size) ||
+        (descriptor.inputOffset < descriptor.outputOffset + size &&
+         descriptor.outputOffset < descriptor.inputOffset + size))
+    {
+        *message = "invalid slot descriptor";
+        return -1;
+    }
+    if (reserveStencilTmpImage(descriptor.width, descriptor.height) != 0)
+    {
+        *message = "out of memory";
+        return -1;
+    }
+
+    double startTime = getTime();
+    connection->replyStart = startTime;
+
+    image_t originalImage, resultImage;
+    viewSharedImage(&originalImage, connection->shared, descriptor.inputOffset,
+                    descriptor.width, descriptor.height, descriptor.maxValue, descriptor.stride);
+    viewSharedImage(&resultImage, connection->shared, descriptor.outputOffset,
+                    descriptor.width, descriptor.height, descriptor.maxValue, descriptor.stride);
+    process(&resultImage, &originalImage);
+
+    double processTime = getTime() - startTime;
+
+    (*served)++;
+    snprintf(connection->replyLog, sizeof(connection->replyLog), "serve: [%d] %s %dx%d shm[%ld], process=%.3f ms",
+             *served, name, descriptor.width, descriptor.height, slot, processTime * 1000.0);
+
+    char line[64];
+    int lineLength = snprintf(line, sizeof(line), "OK %.0f\n", processTime * 1e6);
+
+    return sendReply(connection, line, (size_t)lineLength, NULL);
+}
+
+/*======================================================================
+ * 処理した要求の取り除き
+ *======================================================================
+ *   受信領域の先頭の end バイトを取り除く。
+ */
+static void consumeRequest(server_connection_t *connection, size_t end)
+{
+    memmove(connection->buffer, connection->buffer + end, connection->length - end);
+    connection->length -= end;
+
+    return;
+}
+
+/*======================================================================
+ * 1つの要求の処理
+ *======================================================================
+ *   受信したバイト列の先頭に要求がそろっていれば、lookup で選んだ関数
+ * で処理して応答を送り始め、要求の分を受信領域から取り除いて 1 を返す。
+ * まだそろっていない時は 0 を、要求が正しくない時や応答を書き込めなか
+ * った時は -1 を返す(正しくない時は ERROR の応答を返す)。
+ */
+int serveRequest(server_connection_t *connection, batch_lookup_t lookup, int *served)
+{
+    const char *message;
+    unsigned char *buffer = connection->buffer;
+    size_t length = connection->length;
+
+    /* フィルタの名前の1行 */
+    unsigned char *newline = (unsigned char *)memchr(buffer, '\n', length < SERVER_MAX_LINE ? length : SERVER_MAX_LINE);
+    if (newline == NULL)
+    {
+        if (length >= SERVER_MAX_LINE)
+        {
+            message = "request line too long";
+            goto error;
+        }
+        return 0;
+    }
+
+    char name[SERVER_MAX_LINE];
+    size_t nameLength = (size_t)(newline - buffer);
+    size_t start = nameLength + 1;
+    if (nameLength > 0 && buffer[nameLength - 1] == '\r')
+    {
+        nameLength--;
+    }
+    memcpy(name, buffer, nameLength);
+    name[nameLength] = '\0';
+
+    /* 共有メモリの受け取り */
+    if (strcmp(name, "shm") == 0)
+    {
+        if (attachSharedSegment(connection, &message) != 0)
+        {
+            goto error;
+        }
+        consumeRequest(connection, start);
+        return sendReply(connection, "OK 0\n", 5, NULL) != 0 ? -1 : 1;
+    }
+
+    /* 共有メモリの記述子の番号 */
+    char *slotText = strchr(name, ' ');
+    if (slotText != NULL)
+    {
+        *slotText++ = '\0';
+    }
+
+    batch_process_t process = lookup(name);
+    if (process == NULL)
+    {
+        message = "unknown filter";
+        goto error;
+    }
+
+    if (slotText != NULL)
+    {
+        message = NULL;
+        consumeRequest(connection, start);
+        if (serveSharedRequest(connection, process, name, slotText, served, &message) != 0)
+        {
+            if (message == NULL)
+            {
+                return -1;
+            }
+            goto error;
+        }
+        return 1;
+    }
+
+    /* PGM-RAW のヘッダ部分 */
+    int width, height, maxValue;
+    size_t offset;
+    int parsed = parsePgmRawHeader(buffer + start, length - start, &width, &height, &maxValue, &offset);
+    if (parsed < 0)
+    {
+        message = "invalid PGM-RAW header";
+        goto error;
+    }
+    if (parsed == 0)
+    {
+        return 0;
+    }
+
+    /* 画素値データがそろうまで待つ(受信領域は先に確保しておく) */
+    size_t size = (size_t)width * (size_t)height;
+    if (size > SERVER_MAX_PIXELS)
+    {
+        message = "image too large";
+        goto error;
+    }
+    size_t end = start + offset + size;
+    if (length < end)
+    {
+        if (reserveConnectionBuffer(connection, end) != 0)
+        {
+            message = "out of memory";
+            goto error;
+        }
+        return 0;
+    }
+
+    double startTime = getTime();
+    connection->replyStart = startTime;
+
+    /* 元画像は受信領域をそのまま参照する */
+    image_t originalImage;
+    originalImage.width = width;
+    originalImage.height = height;
+    originalImage.maxValue = maxValue;
+    originalImage.data = buffer + start + offset;
+    originalImage.stride = width;
+    originalImage.mapAddress = NULL;
+    originalImage.mapLength = 0;
+    originalImage.loadedLength = size;
+    originalImage.capacity = 0;
+
+    /* 結果画像と tmpImage を先に確保する(確保できない時はこの接続だけを閉じる) */
+    if (tryReuseImage(&connection->resultImage, width, height, maxValue) != 0 ||
+        reserveStencilTmpImage(width, height) != 0)
+    {
+        message = "out of memory";
+        goto error;
+    }
+    process(&connection->resultImage, &originalImage);
+
+    double processTime = getTime() - startTime;
+
+    /* 処理した要求を取り除く */
+    consumeRequest(connection, end);
+
+    /* 応答(結果画像は送り終えるまで使い回さない) */
+    (*served)++;
+    snprintf(connection->replyLog, sizeof(connection->replyLog), "serve: [%d] %s %dx%d, process=%.3f ms",
+             *served, name, width, height, processTime * 1000.0);
+
+    char header[96];
+    int headerLength = snprintf(header, sizeof(header), "OK %.0f\nP5\n%d %d\n%d\n",
+                                processTime * 1e6, width, height, connection->resultImage.maxValue);
+
+    return sendReply(connection, header, (size_t)headerLength, &connection->resultImage) != 0 ? -1 : 1;
+
+/* エラー処理 */
+error:
+    {
+        char line[SERVER_MAX_LINE];
+        int lineLength = snprintf(line, sizeof(line), "ERROR %s\n", message);
+        writeSocket(connection->fd, line, (size_t)lineLength);
+    }
+    return -1;
+}
+
+/*======================================================================
+ * 接続の要求の処理
+ *======================================================================
+ *   受信領域にそろっている要求を、応答の送信が終わっている間だけ順に
+ * 処理する。接続を閉じる時は -1 を返す。
+ */
+static int serveConnection(server_connection_t *connection, batch_lookup_t lookup, int *served)
+{
+    while (connection->replySize == 0)
+    {
+        int result = serveRequest(connection, lookup, served);
+        if (result <= 0)
+        {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/*======================================================================
+ * 待ち受けるソケットの作成
+ *======================================================================
+ *   const char *path に Unix ドメインソケットを作る。前回のソケットが
+ * 残っていれば消す(ソケット以外のファイルは消さずにエラーにする)。
+ */
+int openServerSocket(const char *path)
+{
+    struct sockaddr_un address;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fputs("The socket path is too long\n", stderr);
+        exit(1);
+    }
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fputs("The socket path exists and is not a socket\n", stderr);
+            exit(1);
+        }
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        fputs("Creating a socket was failed\n", stderr);
+        exit(1);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SERVER_MAX_CONNECTIONS) != 0)
+    {
+        fputs("Binding the socket was failed\n", stderr);
+        exit(1);
+    }
+
+    return fd;
+}
+
+/*======================================================================
+ * サーバ
+ *======================================================================
+ *   const char *path の Unix ドメインソケットで要求を受け付け、lookup
+ * で名前から選んだ関数で処理して応答を返す。複数の接続を poll で待ち、
+ * 要求は1つずつ処理する(1つの要求の中はスレッドプールで並列に処理す
+ * る)。応答を送っている接続は POLLOUT を待って続きを送り、その間は受
+ * 信しない。SIGINT、SIGTERM で、ソケットを消して終了する。
+ */
+int runServer(const char *path, batch_lookup_t lookup)
+{
+    static server_connection_t connections[SERVER_MAX_CONNECTIONS];
+    struct pollfd fds[SERVER_MAX_CONNECTIONS + 1];
+    int served = 0;
+
+    /* 閉じた接続への書き込みで終了しないようにする */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestServerStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    /* 要求ごとの確認用の表示はしない */
+    showDiagnostics = 0;
+
+    int listenFd = openServerSocket(path);
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++)
+    {
+        connections[i].fd = -1;
+        connections[i].pendingFd = -1;
+    }
+
+    printf("serve: socket=%s, threads=%d\n", path, getThreadCount());
+    fflush(stdout);
+
+    while (!serverStopRequested)
+    {
+        /* 待つソケット */
+        int count = 0;
+        fds[count].fd = listenFd;
+        fds[count].events = POLLIN;
+        count++;
+        for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++)
+        {
+            fds[count].fd = connections[i].fd;
+            fds[count].events = connections[i].replySize > 0 ? POLLOUT : POLLIN;
+            count++;
+        }
+
+        if (poll(fds, count, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fputs("poll was failed\n", stderr);
+            break;
+        }
+
+        /* 新しい接続 */
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0)
+            {
+                int i = 0;
+                while (i < SERVER_MAX_CONNECTIONS && connections[i].fd >= 0)
+                {
+                    i++;
+                }
+                if (i < SERVER_MAX_CONNECTIONS)
+                {
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    connections[i].fd = fd;
+                    connections[i].length = 0;
+                }
+                else
+                {
+                    writeSocket(fd, "ERROR too many connections\n", 27);
+                    close(fd);
+                }
+            }
+        }
+
+        /* 受信と要求の処理 */
+        for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++)
+        {
+            server_connection_t *connection = &connections[i];
+            if (connection->fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+
+            /* 応答の続きを送り、送り終えたら受信済みの要求を処理する */
+            if (connection->replySize > 0)
+            {
+                if (flushReply(connection) != 0 || serveConnection(connection, lookup, &served) != 0)
+                {
+                    closeConnection(connection);
+                }
+                continue;
+            }
+
+            if (reserveConnectionBuffer(connection, connection->length + SERVER_READ_CHUNK) != 0)
+            {
+                writeSocket(connection->fd, "ERROR out of memory\n", 20);
+                closeConnection(connection);
+                continue;
+            }
+            ssize_t received = receiveSocket(connection);
+            if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                continue;
+            }
+            if (received <= 0)
+            {
+                closeConnection(connection);
+                continue;
+            }
+            connection->length += (size_t)received;
+
+            if (serveConnection(connection, lookup, &served) != 0)
+            {
+                closeConnection(connection);
+            }
+        }
+    }
+
+    /* 終了 */
+    for (int i = 0; i < SERVER_MAX_CONNECTIONS; i++)
+    {
+        if (connections[i].fd >= 0)
+        {
+            closeConnection(&connections[i]);
+        }
+    }
+    close(listenFd);
+    unlink(path);
+
+    printf("serve: requests=%d\n", served);
+
+    return 0;
+}
+
+/*======================================================================
+ * サーバへの接続
+ *======================================================================
+ */
+static int connectServer(const char *path)
+{
+    struct sockaddr_un address;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        fputs("Connecting to the server was failed\n", stderr);
+        exit(1);
+    }
+
+    return fd;
+}
+
+/*======================================================================
+ * サーバの応答の1行の読み込み
+ *======================================================================
+ *   "OK <microseconds>" ならば処理時間を返し、それ以外はエラーにする。
+ */
+static long readServerResponse(FILE *fp)
+{
+    char line[SERVER_MAX_LINE];
+    long microseconds;
+
+    line[0] = '\0';
+    if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "OK %ld", &microseconds) != 1)
+    {
+        fprintf(stderr, "The server returned %s", line[0] != '\0' ? line : "nothing\n");
+        exit(1);
+    }
+
+    return microseconds;
+}
+
+/*======================================================================
+ * サーバへの要求
+ *======================================================================
+ *   const char *path のサーバに、フィルタの名前 filter と入力ファイル
+ * FILE *infp の画像を送り、結果の画像を出力ファイル FILE *outfp に書
+ * き込む。サーバの処理時間(マイクロ秒)を返す。
+ */
+long requestServer(const char *path, const char *filter, FILE *infp, FILE *outfp)
+{
+    image_t image;
+    char line[SERVER_MAX_LINE];
+
+    readPgmRawHeader(infp, &image);
+    readPgmRawBitmapData(infp, &image);
+
+    int fd = connectServer(path);
+
+    /* 要求 */
+    int lineLength = snprintf(line, sizeof(line), "%s\nP5\n%d %d\n%d\n", filter, image.width, image.height, image.maxValue);
+    if (writeSocket(fd, line, (size_t)lineLength) != 0 ||
+        writeSocketImage(fd, &image) != 0)
+    {
+        fputs("Sending the request was failed\n", stderr);
+        exit(1);
+    }
+
+    /* 要求はこれだけなので、送信側を閉じる(結果の画像を最後まで読める */
+    /* ように、サーバは応答の後に接続を閉じる) */
+    shutdown(fd, SHUT_WR);
+
+    /* 応答の1行目と、結果の画像 */
+    FILE *fp = fdopen(fd, "rb");
+    if (fp == NULL)
+    {
+        fputs("Reading the response was failed\n", stderr);
+        exit(1);
+    }
+    long microseconds = readServerResponse(fp);
+
+    image_t resultImage;
+    readPgmRawHeader(fp, &resultImage);
+    readPgmRawBitmapData(fp, &resultImage);
+    writePgmRawHeader(outfp, &resultImage);
+    writePgmRawBitmapData(outfp, &resultImage);
+
+    fclose(fp);
+    freeImage(&image);
+    freeImage(&resultImage);
+
+    return microseconds;
+}
+
+/*======================================================================
+ * 共有メモリの作成
+ *======================================================================
+ *   size バイトの共有メモリ(memfd)を作って割り当て、先頭の構造体を初
+ * 期化する。サーバが受け付けるように、縮められないように封印する(大
+ * きくすることはできる)。ファイル記述子を返し、割り当てた領域を
+ * shared に入れる。
+ */
+int createSharedSegment(size_t size, unsigned char **shared)
+{
+    int fd = -1;
+
+#ifdef F_SEAL_SHRINK
+    fd = memfd_create("sample_filter", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0 && (ftruncate(fd, (off_t)size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) != 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+#endif
+    if (fd < 0)
+    {
+        fputs("Creating shared memory was failed\n", stderr);
+        exit(1);
+    }
+
+    void *address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        fputs("Mapping shared memory was failed\n", stderr);
+        exit(1);
+    }
+
+    shared_header_t *header = (shared_header_t *)address;
+    memset(header, 0, sizeof(shared_header_t));
+    header->magic = SHARED_MAGIC;
+    header->slotCount = SHARED_SLOT_COUNT;
+    header->size = size;
+
+    *shared = (unsigned char *)address;
+
+    return fd;
+}
+
+/*======================================================================
+ * 共有メモリのファイル記述子の送信
+ *======================================================================
+ *   ソケット int fd に、"shm" の1行と一緒に共有メモリのファイル記述子
+ * int sharedFd を送る。
+ */
+static void sendSharedSegment(int fd, int sharedFd)
+{
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr message;
+    char line[] = "shm\n";
+
+    iov.iov_base = line;
+    iov.iov_len = sizeof(line) - 1;
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sharedFd, sizeof(int));
+
+    if (sendmsg(fd, &message, 0) != (ssize_t)iov.iov_len)
+    {
+        fputs("Sending the shared memory was failed\n", stderr);
+        exit(1);
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 共有メモリを使うサーバへの要求
+ *======================================================================
+ *   requestServer() と同じことを、画像をソケットで送受信せずに行う。
+ * 入力画像と結果画像を置く共有メモリを作ってサーバに渡し、入力画像を
+ * 共有メモリに書いて記述子 0 の処理を要求する。サーバは結果を共有メモ
+ * リに直接書き込む。サーバの処理時間(マイクロ秒)を返す。
+ */
+long requestServerShared(const char *path, const char *filter, FILE *infp, FILE *outfp)
+{
+    image_t image, originalImage, resultImage;
+    unsigned char *shared;
+    char line[SERVER_MAX_LINE];
+
+    readPgmRawHeader(infp, &image);
+    readPgmRawBitmapData(infp, &image);
+
+    /* 先頭の構造体、入力画像、結果画像の順に、各行の先頭を境界に合わせ */
+    /* て置く */
+    int stride = getAlignedStride(image.width, sizeof(unsigned char));
+    size_t size = (size_t)stride * (size_t)image.height;
+    size_t inputOffset = (sizeof(shared_header_t) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+    size_t outputOffset = inputOffset + size;
+    size_t sharedLength = outputOffset + size;
+
+    int sharedFd = createSharedSegment(sharedLength, &shared);
+    viewSharedImage(&originalImage, shared, inputOffset, image.width, image.height, image.maxValue, stride);
+    viewSharedImage(&resultImage, shared, outputOffset, image.width, image.height, image.maxValue, stride);
+    copyImageData(&originalImage, &image);
+
+    shared_slot_t *slot = &((shared_header_t *)shared)->slots[0];
+    slot->width = image.width;
+    slot->height = image.height;
+    slot->maxValue = image.maxValue;
+    slot->stride = stride;
+    slot->inputOffset = inputOffset;
+    slot->outputOffset = outputOffset;
+
+    /* 要求 */
+    int fd = connectServer(path);
+    sendSharedSegment(fd, sharedFd);
+    close(sharedFd);
+
+    int lineLength = snprintf(line, sizeof(line), "%s 0\n", filter);
+    if (writeSocket(fd, line, (size_t)lineLength) != 0)
+    {
+        fputs("Sending the request was failed\n", stderr);
+        exit(1);
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* 応答("shm" と処理の要求の2行) */
+    FILE *fp = fdopen(fd, "rb");
+    if (fp == NULL)
+    {
+        fputs("Reading the response was failed\n", stderr);
+        exit(1);
+    }
+    readServerResponse(fp);
+    long microseconds = readServerResponse(fp);
+    fclose(fp);
+
+    writePgmRawHeader(outfp, &resultImage);
+    writePgmRawBitmapData(outfp, &resultImage);
+
+    munmap(shared, sharedLength);
+    freeImage(&image);
+
+    return microseconds;
+}
+
+#else
+
+int runServer(const char *path, batch_lookup_t lookup)
+{
+    (void)path;
+    (void)lookup;
+    fputs("The server mode is not supported on this platform\n", stderr);
+    exit(1);
+}
+
+long requestServer(const char *path, const char *filter, FILE *infp, FILE *outfp)
+{
+    (void)path;
+    (void)filter;
+    (void)infp;
+    (void)outfp;
+    fputs("The server mode is not supported on this platform\n", stderr);
+    exit(1);
+}
+
+long requestServerShared(const char *path, const char *filter, FILE *infp, FILE *outfp)
+{
+    (void)path;
+    (void)filter;
+    (void)infp;
+    (void)outfp;
+    fputs("The server mode is not supported on this platform\n", stderr);
+    exit(1);
+}
+
+#endif
+
+#endif /* SERVER_H */
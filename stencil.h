@@ -0,0 +1,1061 @@
+/*
+ * 3x3 ステンシル演算
+ *
+ *   sample_1_*.c で使う 3x3 のフィルタ(Prewitt, Sobel, 4近傍・8近傍ラ
+ * プラシアン)を、unsigned char の画像に対して計算する。パディングを加
+ * えた画像は作らず、画像の外側は指定した方法で補う。x86 では SSE2 ま
+ * たは AVX2 で 16 画素または 32 画素ずつ int16 で計算し、使える命令
+ * セットを実行時に cpuid で調べて選ぶ。どの命令セットでも、結果は 1
+ * 画素ずつ計算した場合と完全に同じになる。
+ */
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "filter.h"
+
+/*
+ * フィルタの値から結果画像の画素値への変換方法
+ */
+#define STENCIL_OUTPUT_NORMALIZE 0 /* 最小値から最大値までを [0, maxValue] に正規化する */
+#define STENCIL_OUTPUT_CLAMP 1     /* [0, 255] にクリッピングする */
+
+/*
+ * ステンシルの種類
+ */
+#define STENCIL_PREWITT_L2 0 /* Prewitt, sqrt(dfdx^2 + dfdy^2) */
+#define STENCIL_PREWITT_L1 1 /* Prewitt, |dfdx| + |dfdy| */
+#define STENCIL_SOBEL_L2 2   /* Sobel, sqrt(dfdx^2 + dfdy^2) */
+#define STENCIL_SOBEL_L1 3   /* Sobel, |dfdx| + |dfdy| */
+#define STENCIL_LAPLACIAN4 4 /* 4近傍ラプラシアン */
+#define STENCIL_LAPLACIAN8 5 /* 8近傍ラプラシアン */
+#define STENCIL_PREWITT_AMBM 6 /* Prewitt, max + 3/8 min (sqrt の近似) */
+#define STENCIL_SOBEL_AMBM 7   /* Sobel, max + 3/8 min (sqrt の近似) */
+
+/*
+ * 勾配の大きさの計算方法
+ */
+#define MAGNITUDE_EXACT 0  /* sqrt(dfdx^2 + dfdy^2) を切り捨てた値 */
+#define MAGNITUDE_APPROX 1 /* max(|dfdx|, |dfdy|) + 3/8 min(|dfdx|, |dfdy|) */
+static const char *magnitudeNames[] = {"exact", "approx"};
+
+/*
+ * 登録されているステンシルの一覧
+ *   X(種類, 名前, 結果画像への変換方法) の形で並べる。各命令セットの1
+ * 行分の関数の種類ごとの分岐と、名前の表 stencilNames[] はこの一覧か
+ * ら生成する(registry.h のフィルタの登録もこの一覧を使う)。ステンシル
+ * を加える時は、種類の番号を定義し、stencilPixel()、stencilSse2()、
+ * stencilAvx2() に計算を加えて、ここに1行加える。実行時に与える任意
+ * のカーネルは kernel.h で計算する。
+ */
+#define STENCIL_LIST(X)                                             \
+    X(STENCIL_PREWITT_L2, "prewitt-l2", STENCIL_OUTPUT_NORMALIZE)   \
+    X(STENCIL_PREWITT_L1, "prewitt-l1", STENCIL_OUTPUT_NORMALIZE)   \
+    X(STENCIL_SOBEL_L2, "sobel-l2", STENCIL_OUTPUT_NORMALIZE)       \
+    X(STENCIL_SOBEL_L1, "sobel-l1", STENCIL_OUTPUT_NORMALIZE)       \
+    X(STENCIL_LAPLACIAN4, "laplace4", STENCIL_OUTPUT_CLAMP)         \
+    X(STENCIL_LAPLACIAN8, "laplace8", STENCIL_OUTPUT_CLAMP)         \
+    X(STENCIL_PREWITT_AMBM, "prewitt-ambm", STENCIL_OUTPUT_NORMALIZE) \
+    X(STENCIL_SOBEL_AMBM, "sobel-ambm", STENCIL_OUTPUT_NORMALIZE)
+
+#define STENCIL_NAME_ENTRY(kind, name, output) [kind] = name,
+static const char *stencilNames[] = {STENCIL_LIST(STENCIL_NAME_ENTRY)};
+#define STENCIL_COUNT ((int)(sizeof(stencilNames) / sizeof(stencilNames[0])))
+
+/*
+ * 1行分の関数の種類ごとの分岐
+ *   STENCIL_ROW_KIND を種類ごとの関数の名前に定義してから、switch の中
+ * で STENCIL_LIST(STENCIL_ROW_CASE) と書く。各 case では種類を定数で
+ * 渡すので、インライン展開された関数の中の種類による分岐は畳み込まれ、
+ * 種類ごとに特殊化された関数になる。
+ */
+#define STENCIL_ROW_CASE(kind, name, output)                                           \
+    case kind:                                                                         \
+        STENCIL_ROW_KIND(row0, row1, row2, out, x0, x1, minValue, maxValue, kind);     \
+        break;
+
+/*======================================================================
+ * 名前からのステンシルの種類の取得
+ *======================================================================
+ *   const char *name の名前で登録されているステンシルの種類を返す。登
+ * 録されていない時は -1 を返す。
+ */
+int findStencil(const char *name)
+{
+    for (int i = 0; i < STENCIL_COUNT; i++)
+    {
+        if (stencilNames[i] != NULL && strcmp(name, stencilNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*======================================================================
+ * 勾配の大きさの計算方法の取得
+ *======================================================================
+ *   環境変数 FILTER_MAGNITUDE (exact または approx)で指定する。指定し
+ * なければ MAGNITUDE_EXACT とする。
+ */
+int getMagnitudeMode(void)
+{
+    const char *env = getenv("FILTER_MAGNITUDE");
+
+    if (env == NULL)
+    {
+        return MAGNITUDE_EXACT;
+    }
+    for (int i = 0; i < (int)(sizeof(magnitudeNames) / sizeof(magnitudeNames[0])); i++)
+    {
+        if (strcmp(env, magnitudeNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    fputs("FILTER_MAGNITUDE must be exact or approx\n", stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * 勾配の大きさの計算方法に合わせたステンシルの種類
+ *======================================================================
+ *   MAGNITUDE_APPROX の時は、sqrt を使う種類を近似する種類に置き換えて
+ * 返す。それ以外の種類はそのまま返す。
+ */
+int getMagnitudeStencil(int stencil)
+{
+    if (getMagnitudeMode() == MAGNITUDE_APPROX)
+    {
+        if (stencil == STENCIL_PREWITT_L2)
+        {
+            return STENCIL_PREWITT_AMBM;
+        }
+        if (stencil == STENCIL_SOBEL_L2)
+        {
+            return STENCIL_SOBEL_AMBM;
+        }
+    }
+
+    return stencil;
+}
+
+/*======================================================================
+ * 勾配の大きさの近似の誤差の表示
+ *======================================================================
+ *   max + 3/8 min の誤差は、連続量では sqrt(dfdx^2 + dfdy^2) に対して
+ * -2.8% から +6.8% (min/max が 1 の時と 3/8 の時)。整数の |dfdx|,
+ * |dfdy| <= 1020 の全組み合わせで、切り捨てた sqrt との差は -40 から
+ * +75 である。stencil が近似する種類の時に表示する。
+ */
+void printMagnitudeError(int stencil)
+{
+    if (stencil == STENCIL_PREWITT_AMBM || stencil == STENCIL_SOBEL_AMBM)
+    {
+        printDiagnostic("magnitude: mode=approx, max+3/8*min, error=-2.8%%..+6.8%%, abs=-40..+75\n");
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 整数の平方根
+ *======================================================================
+ *   0 以上 2^22 未満の整数 n について、sqrt(n) の小数点以下を切り捨て
+ * た値を返す。倍精度の sqrt() の代わりに単精度の sqrt を使う。
+ *   n は単精度で誤差なく表せ、単精度の sqrt は正しく丸められる。切り捨
+ * てた値が変わるのは、sqrt(n) が整数 k より小さく、k に丸められる時だ
+ * けだが、k^2 > n の時 k - sqrt(n) >= k - sqrt(k^2 - 1) > 1/(2k) で、
+ * k <= 2048 ではこれは単精度の k 付近の刻みの半分(2^-13)より大きい。
+ * したがって結果は倍精度の sqrt を切り捨てた値と一致する(勾配の2乗和
+ * は 2080800 以下)。
+ */
+static inline int stencilIsqrt(int n)
+{
+    return (int)sqrtf((float)n);
+}
+
+/*======================================================================
+ * 1画素のステンシル演算
+ *======================================================================
+ *   連続する3行 row0, row1, row2 の x-1, x, x+1 列目からなる 3x3 の近
+ * 傍について、stencil の種類のフィルタの値を返す。勾配フィルタは、横方
+ * 向のカーネル
+ *     -1 0 1
+ *     -w 0 w
+ *     -1 0 1
+ * と縦方向のカーネル(その転置)による畳み込み dfdx, dfdy を、近傍を1回
+ * だけ読み込んで同時に求める(w は Prewitt で 1、Sobel で 2)。係数が 0
+ * の画素は読まない。sqrt の結果は小数点以下を切り捨てる。
+ *   stencil に定数を渡すと、展開された呼び出し元で分岐が畳み込まれる。
+ */
+static inline int stencilPixel(const unsigned char *row0, const unsigned char *row1,
+                               const unsigned char *row2, int x, const int stencil)
+{
+    int p00 = row0[x - 1], p01 = row0[x], p02 = row0[x + 1];
+    int p10 = row1[x - 1], p11 = row1[x], p12 = row1[x + 1];
+    int p20 = row2[x - 1], p21 = row2[x], p22 = row2[x + 1];
+
+    if (stencil == STENCIL_LAPLACIAN4)
+    {
+        return p01 + p10 + p12 + p21 - 4 * p11;
+    }
+    if (stencil == STENCIL_LAPLACIAN8)
+    {
+        return p00 + p01 + p02 + p10 + p12 + p20 + p21 + p22 - 8 * p11;
+    }
+
+    int weight = (stencil == STENCIL_SOBEL_L2 || stencil == STENCIL_SOBEL_L1 || stencil == STENCIL_SOBEL_AMBM) ? 2 : 1;
+    int dfdx = (p02 - p00) + weight * (p12 - p10) + (p22 - p20);
+    int dfdy = (p20 - p00) + weight * (p21 - p01) + (p22 - p02);
+
+    if (stencil == STENCIL_PREWITT_L2 || stencil == STENCIL_SOBEL_L2)
+    {
+        return stencilIsqrt(dfdx * dfdx + dfdy * dfdy);
+    }
+    if (stencil == STENCIL_PREWITT_AMBM || stencil == STENCIL_SOBEL_AMBM)
+    {
+        int ax = abs(dfdx);
+        int ay = abs(dfdy);
+        int mx = ax > ay ? ax : ay;
+        int mn = ax > ay ? ay : ax;
+        return mx + ((3 * mn) >> 3);
+    }
+    return abs(dfdx) + abs(dfdy);
+}
+
+/*======================================================================
+ * 1行分のステンシル演算(スカラー)
+ *======================================================================
+ *   出力画像の x0 列目から x1-1 列目までを1画素ずつ計算して
+ * int16_t *out にセットし、最小値 *minValue、最大値 *maxValue を更新する。
+ */
+static inline void stencilRowScalarKind(const unsigned char *row0, const unsigned char *row1,
+                                        const unsigned char *row2, int16_t *out, int x0, int x1,
+                                        int *minValue, int *maxValue, const int stencil)
+{
+    int tmp_image_minValue = *minValue;
+    int tmp_image_maxValue = *maxValue;
+
+    for (int x = x0; x < x1; x++)
+    {
+        int g = stencilPixel(row0, row1, row2, x, stencil);
+
+        /* データのセット */
+        if (out != NULL)
+        {
+            out[x] = (int16_t)g;
+        }
+
+        /* 最小値の更新 */
+        if (tmp_image_minValue > g)
+        {
+            tmp_image_minValue = g;
+        }
+        /* 最大値の更新 */
+        if (tmp_image_maxValue < g)
+        {
+            tmp_image_maxValue = g;
+        }
+    }
+
+    *minValue = tmp_image_minValue;
+    *maxValue = tmp_image_maxValue;
+
+    return;
+}
+
+static void stencilRowScalar(const unsigned char *row0, const unsigned char *row1,
+                             const unsigned char *row2, int16_t *out, int x0, int x1,
+                             int *minValue, int *maxValue, int stencil)
+{
+#define STENCIL_ROW_KIND stencilRowScalarKind
+    switch (stencil)
+    {
+        STENCIL_LIST(STENCIL_ROW_CASE)
+    }
+#undef STENCIL_ROW_KIND
+
+    return;
+}
+
+#ifdef STENCIL_X86
+/*======================================================================
+ * 8画素分のステンシル演算(SSE2)
+ *======================================================================
+ *   int16 に広げた 3x3 の近傍 p00 〜 p22 (各8画素)から、stencil の種類
+ * のフィルタの値を int16 で返す。|dfdx|, |dfdy| は 1020 以下なので
+ * int16 に収まる。sqrt(dfdx^2 + dfdy^2) は、dfdx^2 + dfdy^2 (2080800
+ * 以下)を int32 で求め、単精度の sqrt で計算して切り捨てる。この範囲
+ * の整数では、単精度の sqrt を切り捨てた値と倍精度の sqrt を切り捨てた
+ * 値は一致する。
+ */
+static inline STENCIL_SSE2_TARGET __m128i stencilSse2(__m128i p00, __m128i p01, __m128i p02,
+                                                      __m128i p10, __m128i p11, __m128i p12,
+                                                      __m128i p20, __m128i p21, __m128i p22,
+                                                      const int stencil)
+{
+    if (stencil == STENCIL_LAPLACIAN4)
+    {
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(p01, p21), _mm_add_epi16(p10, p12));
+        return _mm_sub_epi16(sum, _mm_slli_epi16(p11, 2));
+    }
+    if (stencil == STENCIL_LAPLACIAN8)
+    {
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(p00, p01), _mm_add_epi16(p02, p10)),
+                                    _mm_add_epi16(_mm_add_epi16(p12, p20), _mm_add_epi16(p21, p22)));
+        return _mm_sub_epi16(sum, _mm_slli_epi16(p11, 3));
+    }
+
+    __m128i cx = _mm_sub_epi16(p12, p10);
+    __m128i cy = _mm_sub_epi16(p21, p01);
+    if (stencil == STENCIL_SOBEL_L2 || stencil == STENCIL_SOBEL_L1 || stencil == STENCIL_SOBEL_AMBM)
+    {
+        cx = _mm_slli_epi16(cx, 1);
+        cy = _mm_slli_epi16(cy, 1);
+    }
+    __m128i dfdx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p02, p00), _mm_sub_epi16(p22, p20)), cx);
+    __m128i dfdy = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(p20, p00), _mm_sub_epi16(p22, p02)), cy);
+
+    if (stencil == STENCIL_PREWITT_L2 || stencil == STENCIL_SOBEL_L2)
+    {
+        __m128i lo = _mm_unpacklo_epi16(dfdx, dfdy);
+        __m128i hi = _mm_unpackhi_epi16(dfdx, dfdy);
+        __m128 sqlo = _mm_cvtepi32_ps(_mm_madd_epi16(lo, lo));
+        __m128 sqhi = _mm_cvtepi32_ps(_mm_madd_epi16(hi, hi));
+        return _mm_packs_epi32(_mm_cvttps_epi32(_mm_sqrt_ps(sqlo)), _mm_cvttps_epi32(_mm_sqrt_ps(sqhi)));
+    }
+
+    __m128i zero = _mm_setzero_si128();
+    __m128i absx = _mm_max_epi16(dfdx, _mm_sub_epi16(zero, dfdx));
+    __m128i absy = _mm_max_epi16(dfdy, _mm_sub_epi16(zero, dfdy));
+    if (stencil == STENCIL_PREWITT_AMBM || stencil == STENCIL_SOBEL_AMBM)
+    {
+        __m128i mn = _mm_min_epi16(absx, absy);
+        __m128i mn3 = _mm_add_epi16(mn, _mm_slli_epi16(mn, 1));
+        return _mm_add_epi16(_mm_max_epi16(absx, absy), _mm_srai_epi16(mn3, 3));
+    }
+    return _mm_add_epi16(absx, absy);
+}
+
+/*======================================================================
+ * 1行分のステンシル演算(SSE2)
+ *======================================================================
+ *   出力画像の x0 列目から x1-1 列目までを 16 画素ずつ計算して
+ * int16_t *out にセットし、最小値 *minValue、最大値 *maxValue を更新す
+ * る。16 画素に満たない残りはスカラーで計算する。
+ */
+static inline STENCIL_SSE2_TARGET void stencilRowSse2Kind(const unsigned char *row0, const unsigned char *row1,
+                                                          const unsigned char *row2, int16_t *out, int x0, int x1,
+                                                          int *minValue, int *maxValue, const int stencil)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i vmin = _mm_set1_epi16((short)*minValue);
+    __m128i vmax = _mm_set1_epi16((short)*maxValue);
+    int x = x0;
+
+    for (; x + 16 <= x1; x += 16)
+    {
+        __m128i a00 = _mm_loadu_si128((const __m128i *)(row0 + x - 1));
+        __m128i a01 = _mm_loadu_si128((const __m128i *)(row0 + x));
+        __m128i a02 = _mm_loadu_si128((const __m128i *)(row0 + x + 1));
+        __m128i a10 = _mm_loadu_si128((const __m128i *)(row1 + x - 1));
+        __m128i a11 = _mm_loadu_si128((const __m128i *)(row1 + x));
+        __m128i a12 = _mm_loadu_si128((const __m128i *)(row1 + x + 1));
+        __m128i a20 = _mm_loadu_si128((const __m128i *)(row2 + x - 1));
+        __m128i a21 = _mm_loadu_si128((const __m128i *)(row2 + x));
+        __m128i a22 = _mm_loadu_si128((const __m128i *)(row2 + x + 1));
+
+        __m128i r[2];
+        r[0] = stencilSse2(_mm_unpacklo_epi8(a00, zero), _mm_unpacklo_epi8(a01, zero), _mm_unpacklo_epi8(a02, zero),
+                           _mm_unpacklo_epi8(a10, zero), _mm_unpacklo_epi8(a11, zero), _mm_unpacklo_epi8(a12, zero),
+                           _mm_unpacklo_epi8(a20, zero), _mm_unpacklo_epi8(a21, zero), _mm_unpacklo_epi8(a22, zero),
+                           stencil);
+        r[1] = stencilSse2(_mm_unpackhi_epi8(a00, zero), _mm_unpackhi_epi8(a01, zero), _mm_unpackhi_epi8(a02, zero),
+                           _mm_unpackhi_epi8(a10, zero), _mm_unpackhi_epi8(a11, zero), _mm_unpackhi_epi8(a12, zero),
+                           _mm_unpackhi_epi8(a20, zero), _mm_unpackhi_epi8(a21, zero), _mm_unpackhi_epi8(a22, zero),
+                           stencil);
+
+        for (int i = 0; i < 2; i++)
+        {
+            vmin = _mm_min_epi16(vmin, r[i]);
+            vmax = _mm_max_epi16(vmax, r[i]);
+
+            if (out != NULL)
+            {
+                _mm_storeu_si128((__m128i *)(out + x + 8 * i), r[i]);
+            }
+        }
+    }
+
+    /* 最小値、最大値の集約 */
+    short lanes_min[8], lanes_max[8];
+    _mm_storeu_si128((__m128i *)lanes_min, vmin);
+    _mm_storeu_si128((__m128i *)lanes_max, vmax);
+    for (int i = 0; i < 8; i++)
+    {
+        if (*minValue > lanes_min[i])
+        {
+            *minValue = lanes_min[i];
+        }
+        if (*maxValue < lanes_max[i])
+        {
+            *maxValue = lanes_max[i];
+        }
+    }
+
+    /* 残りの画素 */
+    stencilRowScalarKind(row0, row1, row2, out, x, x1, minValue, maxValue, stencil);
+
+    return;
+}
+
+static STENCIL_SSE2_TARGET void stencilRowSse2(const unsigned char *row0, const unsigned char *row1,
+                                               const unsigned char *row2, int16_t *out, int x0, int x1,
+                                               int *minValue, int *maxValue, int stencil)
+{
+#define STENCIL_ROW_KIND stencilRowSse2Kind
+    switch (stencil)
+    {
+        STENCIL_LIST(STENCIL_ROW_CASE)
+    }
+#undef STENCIL_ROW_KIND
+
+    return;
+}
+
+/*======================================================================
+ * 16画素分のステンシル演算(AVX2)
+ *======================================================================
+ *   stencilSse2() と同じ計算を 16 画素ずつ行う。AVX2 の unpack と pack
+ * は 128 ビットずつ行われるので、unpack した後に pack すると画素の順
+ * 番は元に戻る。
+ */
+static inline STENCIL_AVX2_TARGET __m256i stencilAvx2(__m256i p00, __m256i p01, __m256i p02,
+                                                      __m256i p10, __m256i p11, __m256i p12,
+                                                      __m256i p20, __m256i p21, __m256i p22,
+                                                      const int stencil)
+{
+    if (stencil == STENCIL_LAPLACIAN4)
+    {
+        __m256i sum = _mm256_add_epi16(_mm256_add_epi16(p01, p21), _mm256_add_epi16(p10, p12));
+        return _mm256_sub_epi16(sum, _mm256_slli_epi16(p11, 2));
+    }
+    if (stencil == STENCIL_LAPLACIAN8)
+    {
+        __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(p00, p01), _mm256_add_epi16(p02, p10)),
+                                       _mm256_add_epi16(_mm256_add_epi16(p12, p20), _mm256_add_epi16(p21, p22)));
+        return _mm256_sub_epi16(sum, _mm256_slli_epi16(p11, 3));
+    }
+
+    __m256i cx = _mm256_sub_epi16(p12, p10);
+    __m256i cy = _mm256_sub_epi16(p21, p01);
+    if (stencil == STENCIL_SOBEL_L2 || stencil == STENCIL_SOBEL_L1 || stencil == STENCIL_SOBEL_AMBM)
+    {
+        cx = _mm256_slli_epi16(cx, 1);
+        cy = _mm256_slli_epi16(cy, 1);
+    }
+    __m256i dfdx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p02, p00), _mm256_sub_epi16(p22, p20)), cx);
+    __m256i dfdy = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(p20, p00), _mm256_sub_epi16(p22, p02)), cy);
+
+    if (stencil == STENCIL_PREWITT_L2 || stencil == STENCIL_SOBEL_L2)
+    {
+        __m256i lo = _mm256_unpacklo_epi16(dfdx, dfdy);
+        __m256i hi = _mm256_unpackhi_epi16(dfdx, dfdy);
+        __m256 sqlo = _mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo));
+        __m256 sqhi = _mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi));
+        return _mm256_packs_epi32(_mm256_cvttps_epi32(_mm256_sqrt_ps(sqlo)), _mm256_cvttps_epi32(_mm256_sqrt_ps(sqhi)));
+    }
+
+    __m256i absx = _mm256_abs_epi16(dfdx);
+    __m256i absy = _mm256_abs_epi16(dfdy);
+    if (stencil == STENCIL_PREWITT_AMBM || stencil == STENCIL_SOBEL_AMBM)
+    {
+        __m256i mn = _mm256_min_epi16(absx, absy);
+        __m256i mn3 = _mm256_add_epi16(mn, _mm256_slli_epi16(mn, 1));
+        return _mm256_add_epi16(_mm256_max_epi16(absx, absy), _mm256_srai_epi16(mn3, 3));
+    }
+    return _mm256_add_epi16(absx, absy);
+}
+
+/*
+ * 16バイトを読み込んで int16 に広げる
+ */
+#define loadWidenAvx2(p) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(p)))
+
+/*======================================================================
+ * 1行分のステンシル演算(AVX2)
+ *======================================================================
+ *   出力画像の x0 列目から x1-1 列目までを 32 画素ずつ計算して
+ * int16_t *out にセットし、最小値 *minValue、最大値 *maxValue を更新す
+ * る。32 画素に満たない残りはスカラーで計算する。
+ */
+static inline STENCIL_AVX2_TARGET void stencilRowAvx2Kind(const unsigned char *row0, const unsigned char *row1,
+                                                          const unsigned char *row2, int16_t *out, int x0, int x1,
+                                                          int *minValue, int *maxValue, const int stencil)
+{
+    __m256i vmin = _mm256_set1_epi16((short)*minValue);
+    __m256i vmax = _mm256_set1_epi16((short)*maxValue);
+    int x = x0;
+
+    for (; x + 32 <= x1; x += 32)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            int xi = x + 16 * i;
+            __m256i r = stencilAvx2(loadWidenAvx2(row0 + xi - 1), loadWidenAvx2(row0 + xi), loadWidenAvx2(row0 + xi + 1),
+                                    loadWidenAvx2(row1 + xi - 1), loadWidenAvx2(row1 + xi), loadWidenAvx2(row1 + xi + 1),
+                                    loadWidenAvx2(row2 + xi - 1), loadWidenAvx2(row2 + xi), loadWidenAvx2(row2 + xi + 1),
+                                    stencil);
+
+            vmin = _mm256_min_epi16(vmin, r);
+            vmax = _mm256_max_epi16(vmax, r);
+
+            if (out != NULL)
+            {
+                _mm256_storeu_si256((__m256i *)(out + xi), r);
+            }
+        }
+    }
+
+    /* 最小値、最大値の集約 */
+    short lanes_min[16], lanes_max[16];
+    _mm256_storeu_si256((__m256i *)lanes_min, vmin);
+    _mm256_storeu_si256((__m256i *)lanes_max, vmax);
+    for (int i = 0; i < 16; i++)
+    {
+        if (*minValue > lanes_min[i])
+        {
+            *minValue = lanes_min[i];
+        }
+        if (*maxValue < lanes_max[i])
+        {
+            *maxValue = lanes_max[i];
+        }
+    }
+
+    /* 残りの画素 */
+    stencilRowScalarKind(row0, row1, row2, out, x, x1, minValue, maxValue, stencil);
+
+    return;
+}
+
+static STENCIL_AVX2_TARGET void stencilRowAvx2(const unsigned char *row0, const unsigned char *row1,
+                                               const unsigned char *row2, int16_t *out, int x0, int x1,
+                                               int *minValue, int *maxValue, int stencil)
+{
+#define STENCIL_ROW_KIND stencilRowAvx2Kind
+    switch (stencil)
+    {
+        STENCIL_LIST(STENCIL_ROW_CASE)
+    }
+#undef STENCIL_ROW_KIND
+
+    return;
+}
+#endif /* STENCIL_X86 */
+
+/*======================================================================
+ * 1行分のステンシル演算
+ *======================================================================
+ *   命令セット isa の実装で、出力画像の x0 列目から x1-1 列目までを計
+ * 算する。row0, row1, row2 は近傍の3行で、x0-1 列目から x1 列目までを
+ * 読む。out が NULL の時は、最小値と最大値だけを求める。
+ */
+static void stencilRow(int isa, const unsigned char *row0, const unsigned char *row1,
+                       const unsigned char *row2, int16_t *out, int x0, int x1,
+                       int *minValue, int *maxValue, int stencil)
+{
+    switch (isa)
+    {
+#ifdef STENCIL_X86
+    case STENCIL_ISA_AVX2:
+        stencilRowAvx2(row0, row1, row2, out, x0, x1, minValue, maxValue, stencil);
+        break;
+    case STENCIL_ISA_SSE2:
+        stencilRowSse2(row0, row1, row2, out, x0, x1, minValue, maxValue, stencil);
+        break;
+#endif
+    default:
+        stencilRowScalar(row0, row1, row2, out, x0, x1, minValue, maxValue, stencil);
+        break;
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 画像の端の1画素のステンシル演算
+ *======================================================================
+ *   画像 image_t *image の (x, y) の 3x3 の近傍を、画像の外側は border
+ * の方法で補って集め、stencil の種類のフィルタの値を返す。
+ */
+static int stencilBorderPixel(image_t *image, int x, int y, int stencil, int border)
+{
+    unsigned char patch[3][3];
+
+    for (int j = 0; j < 3; j++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            patch[j][i] = getBorderPixel(image, x + i - 1, y + j - 1, border);
+        }
+    }
+
+    return stencilPixel(patch[0], patch[1], patch[2], 1, stencil);
+}
+
+/*======================================================================
+ * 複数行のステンシル演算
+ *======================================================================
+ *   画像 image_t *image の y0 行目から y1-1 行目までについて、stencil
+ * の種類のフィルタの値を求め、y 行目を int16_t *out の
+ * stride * (y - y0) 番目からセットし、最小値 *minValue、最大値
+ * *maxValue を更新する。out が NULL の時は、最小値と最大値だけを求め
+ * る。
+ *   パディングを加えた画像は作らず、画像の外側は border の方法で補う。
+ *   - 内側の行(上下の端以外)の内側の列は、元の画像の3行を直接読んで、
+ *     範囲の確認をせずに計算する。左右の端の1画素ずつは
+ *     stencilBorderPixel() で計算する。
+ *   - 上下の端の行(角を含む)は、近傍の3行だけを左右に1画素ずつ補った
+ *     作業用の行に並べて、内側と同じ実装で計算する。
+ */
+void stencilRows(image_t *image, int16_t *out, int stride, int stencil, int border,
+                 int y0, int y1, int *minValue, int *maxValue)
+{
+    int isa = getStencilIsa();
+    int width = image->width;
+    int height = image->height;
+    unsigned char *work = NULL;
+
+    for (int y = y0; y < y1; y++)
+    {
+        int16_t *row = out != NULL ? out + (size_t)stride * (y - y0) : NULL;
+
+        if (y > 0 && y < height - 1)
+        {
+            /* 内側の行 */
+            const unsigned char *row1 = image->data + (size_t)image->stride * y;
+            const unsigned char *row0 = row1 - image->stride;
+            const unsigned char *row2 = row1 + image->stride;
+            int g;
+
+            stencilRow(isa, row0, row1, row2, row, 1, width - 1, minValue, maxValue, stencil);
+
+            /* 左右の端 */
+            for (int x = 0; x < width; x += width - 1)
+            {
+                g = stencilBorderPixel(image, x, y, stencil, border);
+                if (row != NULL)
+                {
+                    row[x] = (int16_t)g;
+                }
+                if (*minValue > g)
+                {
+                    *minValue = g;
+                }
+                if (*maxValue < g)
+                {
+                    *maxValue = g;
+                }
+                if (width == 1)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            /* 上下の端の行: 近傍の3行を作業用の行に並べる */
+            if (work == NULL)
+            {
+                work = (unsigned char *)malloc(sizeof(unsigned char) * 3 * (width + 2));
+                if (work == NULL)
+                {
+                    fputs("out of memory\n", stderr);
+                    exit(1);
+                }
+            }
+            for (int j = 0; j < 3; j++)
+            {
+                unsigned char *line = work + (width + 2) * j;
+                int sy = getBorderIndex(y + j - 1, height, border);
+
+                if (sy < 0)
+                {
+                    memset(line, 0, width + 2);
+                }
+                else
+                {
+                    line[0] = getBorderPixel(image, -1, sy, border);
+                    memcpy(line + 1, image->data + (size_t)image->stride * sy, width);
+                    line[width + 1] = getBorderPixel(image, width, sy, border);
+                }
+            }
+
+            stencilRow(isa, work + 1, work + (width + 2) + 1, work + 2 * (width + 2) + 1,
+                       row, 0, width, minValue, maxValue, stencil);
+        }
+    }
+
+    free(work);
+
+    return;
+}
+
+/*
+ * ステンシル演算の並列処理に渡す引数
+ */
+typedef struct
+{
+    image_t *image;
+    int16_image_t *tmpImage;
+    int stencil;
+    int border;
+    int minValues[MAX_THREADS]; /* 帯ごとの最小値 */
+    int maxValues[MAX_THREADS]; /* 帯ごとの最大値 */
+} stencil_task_t;
+
+/*======================================================================
+ * ステンシル演算(帯ごとの処理)
+ *======================================================================
+ */
+static void stencilBand(void *arg, int band, int begin, int end)
+{
+    stencil_task_t *task = (stencil_task_t *)arg;
+
+    task->minValues[band] = 255;
+    task->maxValues[band] = 0;
+    stencilRows(task->image, task->tmpImage->data + (size_t)task->tmpImage->stride * begin, task->tmpImage->stride,
+                task->stencil, task->border, begin, end, &task->minValues[band], &task->maxValues[band]);
+
+    return;
+}
+
+/*======================================================================
+ * ステンシル演算によるフィルタリング
+ *======================================================================
+ *   画像 image_t *image の全画素について stencil の種類のフィルタの値
+ * を int16_image_t *tmpImage にセットし、その最小値(初期値 255)と最大値
+ * (初期値 0)もセットする。画像の外側は border の方法で補う。
+ *   出力画像の行を帯に分けてスレッドプールで並列に計算し、帯ごとに求
+ * めた最小値、最大値を最後にまとめる。結果はスレッド数によらない。
+ */
+void stencilImage(image_t *image, int16_image_t *tmpImage, int stencil, int border)
+{
+    stencil_task_t task;
+
+    task.image = image;
+    task.tmpImage = tmpImage;
+    task.stencil = stencil;
+    task.border = border;
+
+    /* 使用する命令セットを並列処理の前に決めておく */
+    getStencilIsa();
+
+    stage_timer_t timer;
+    beginStage(&timer);
+
+    int bands = parallelFor(tmpImage->height, stencilBand, &task);
+
+    int tmp_image_minValue = 255;
+    int tmp_image_maxValue = 0;
+    for (int i = 0; i < bands; i++)
+    {
+        /* 最小値の更新 */
+        if (tmp_image_minValue > task.minValues[i])
+        {
+            tmp_image_minValue = task.minValues[i];
+        }
+        /* 最大値の更新 */
+        if (tmp_image_maxValue < task.maxValues[i])
+        {
+            tmp_image_maxValue = task.maxValues[i];
+        }
+    }
+
+    /* tmpImageの最小値をセット */
+    tmpImage->minValue = tmp_image_minValue;
+    /* tmpImageの最大値をセット */
+    tmpImage->maxValue = tmp_image_maxValue;
+
+    size_t pixels = (size_t)tmpImage->width * tmpImage->height;
+    endStage(&timer, "convolve", pixels * (1 + sizeof(int16_t)), pixels);
+    return;
+}
+
+/*
+ * 2回計算するフィルタリングで、一度に計算する行数
+ *   この行数分のフィルタの値だけを int16 で一時的に持ち、キャッシュに
+ * 収まるうちに結果画像の画素値に変換する。
+ */
+#define STENCIL_FUSED_ROWS 4
+
+/*======================================================================
+ * 2回計算するフィルタリングを行うかどうかの取得
+ *======================================================================
+ *   環境変数 FILTER_FUSED が 0 以外の時に、tmpImage を作らずにフィルタ
+ * を2回計算する。
+ */
+int getFusedMode(void)
+{
+    const char *env = getenv("FILTER_FUSED");
+
+    return env != NULL && atoi(env) != 0;
+}
+
+/*
+ * 2回計算するフィルタリングの並列処理に渡す引数
+ */
+typedef struct
+{
+    image_t *image;
+    image_t *resultImage;
+    int stencil;
+    int border;
+    int output;
+    normalize_table_t table;    /* 正規化の変換表 */
+    int minValues[MAX_THREADS]; /* 帯ごとの最小値 */
+    int maxValues[MAX_THREADS]; /* 帯ごとの最大値 */
+} stencil_fused_task_t;
+
+/*======================================================================
+ * フィルタの値の最小値、最大値(帯ごとの処理)
+ *======================================================================
+ */
+static void stencilMinMaxBand(void *arg, int band, int begin, int end)
+{
+    stencil_fused_task_t *task = (stencil_fused_task_t *)arg;
+
+    task->minValues[band] = 255;
+    task->maxValues[band] = 0;
+    stencilRows(task->image, NULL, 0, task->stencil, task->border, begin, end,
+                &task->minValues[band], &task->maxValues[band]);
+
+    return;
+}
+
+/*======================================================================
+ * フィルタの値の変換(帯ごとの処理)
+ *======================================================================
+ *   STENCIL_FUSED_ROWS 行ずつフィルタの値を計算し、すぐに正規化または
+ * クリッピングして結果画像にセットする。
+ */
+static void stencilOutputBand(void *arg, int band, int begin, int end)
+{
+    stencil_fused_task_t *task = (stencil_fused_task_t *)arg;
+    int width = task->image->width;
+    int minValue = 255;
+    int maxValue = 0;
+
+    (void)band;
+
+    int16_t *rows = (int16_t *)malloc(sizeof(int16_t) * width * STENCIL_FUSED_ROWS);
+    if (rows == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    for (int y0 = begin; y0 < end; y0 += STENCIL_FUSED_ROWS)
+    {
+        int y1 = y0 + STENCIL_FUSED_ROWS < end ? y0 + STENCIL_FUSED_ROWS : end;
+
+        stencilRows(task->image, rows, width, task->stencil, task->border, y0, y1, &minValue, &maxValue);
+
+        for (int y = y0; y < y1; y++)
+        {
+            int16_t *in = rows + (size_t)width * (y - y0);
+            unsigned char *out = task->resultImage->data + (size_t)task->resultImage->stride * y;
+
+            if (task->output == STENCIL_OUTPUT_NORMALIZE)
+            {
+                normalizeRow(in, out, width, &task->table);
+            }
+            else
+            {
+                clampRow(in, out, width);
+            }
+        }
+    }
+
+    free(rows);
+
+    return;
+}
+
+/*======================================================================
+ * 2回計算するフィルタリング
+ *======================================================================
+ *   画像 image_t *image に stencil の種類のフィルタをかけ、output の方
+ * 法で変換した値を image_t *resultImage にセットする。画像全体のフィ
+ * ルタの値(int16_image_t の tmpImage)は作らない。
+ *   STENCIL_OUTPUT_NORMALIZE の時は、1回目はフィルタの値を書き込まず
+ * に最小値(初期値 255)と最大値(初期値 0)だけを求め、2回目にもう一度
+ * フィルタを計算して、数行ずつ正規化して書き込む。計算は2倍になるが、
+ * 1画素2バイトの tmpImage の書き込みと読み直しがなくなる。結果は
+ * stencilImage() と setNormalizedImageData() を使った場合と同じになる。
+ *   STENCIL_OUTPUT_CLAMP の時は、最小値と最大値はいらないので1回だけ
+ * 計算する。
+ */
+void stencilFusedImage(image_t *image, image_t *resultImage, int stencil, int border, int output)
+{
+    stencil_fused_task_t *task = (stencil_fused_task_t *)malloc(sizeof(stencil_fused_task_t));
+    if (task == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    task->image = image;
+    task->resultImage = resultImage;
+    task->stencil = stencil;
+    task->border = border;
+    task->output = output;
+
+    /* 使用する命令セットを並列処理の前に決めておく */
+    getStencilIsa();
+
+    stage_timer_t timer;
+    size_t pixels = (size_t)image->width * image->height;
+
+    /* 1回目(最小値、最大値) */
+    if (output == STENCIL_OUTPUT_NORMALIZE)
+    {
+        beginStage(&timer);
+
+        int bands = parallelFor(image->height, stencilMinMaxBand, task);
+
+        int tmp_image_minValue = 255;
+        int tmp_image_maxValue = 0;
+        for (int i = 0; i < bands; i++)
+        {
+            if (tmp_image_minValue > task->minValues[i])
+            {
+                tmp_image_minValue = task->minValues[i];
+            }
+            if (tmp_image_maxValue < task->maxValues[i])
+            {
+                tmp_image_maxValue = task->maxValues[i];
+            }
+        }
+
+        endStage(&timer, "convolve", pixels, pixels);
+
+        printDiagnostic("tmp_image: minValue=%d, maxValue=%d\n", tmp_image_minValue, tmp_image_maxValue);
+        initNormalizeTable(&task->table, tmp_image_minValue, tmp_image_maxValue, resultImage->maxValue);
+    }
+
+    /* 2回目(変換して書き込む) */
+    beginStage(&timer);
+    parallelFor(image->height, stencilOutputBand, task);
+    endStage(&timer, output == STENCIL_OUTPUT_NORMALIZE ? "convolve_normalize" : "convolve_clamp", pixels * 2, pixels);
+
+    if (output == STENCIL_OUTPUT_NORMALIZE)
+    {
+        freeNormalizeTable(&task->table);
+    }
+    free(task);
+
+    return;
+}
+
+/*
+ * 値がint16型のtmpImage(画像ごとに確保し直さず、スレッドごとに使い回す)
+ */
+static __thread int16_image_t stencilTmpImage;
+
+/*======================================================================
+ * tmpImage の確保
+ *======================================================================
+ *   このスレッドの filterStencilImage() が width × height の画像に使う
+ * tmpImage を先に確保しておく。tmpImage を作らない時(FILTER_FUSED)は
+ * 何もしない。確保できない時は -1 を返す(サーバは処理の前に呼んで、
+ * その要求だけをエラーにする)。
+ */
+int reserveStencilTmpImage(int width, int height)
+{
+    if (getFusedMode())
+    {
+        return 0;
+    }
+
+    return tryReuseInt16Image(&stencilTmpImage, width, height);
+}
+
+/*======================================================================
+ * 3x3 のフィルタによるフィルタリング
+ *======================================================================
+ *   元画像 image_t *originalImage に stencil の種類のフィルタをかけ、
+ * output の方法で [0, 255] の値にして image_t *resultImage にセットす
+ * る。環境変数 FILTER_BORDER、FILTER_FUSED、FILTER_MAGNITUDE に従って、
+ * 画像の外側の補い方、フィルタの値の画像(tmpImage)を作るかどうか、勾
+ * 配の大きさを近似するかどうかを決める。
+ *   tmpImage は画像ごとに確保し直さず、スレッドごとに使い回す。
+ */
+void filterStencilImage(image_t *resultImage, image_t *originalImage, int stencil, int output)
+{
+    /* サイズが違ったらエラー */
+    if (resultImage->width != originalImage->width || resultImage->height != originalImage->height)
+    {
+        fputs("resultImage and originalImage are different size\n", stderr);
+        exit(1);
+    }
+
+    int16_image_t *tmpImage = &stencilTmpImage;
+
+    int original_image_width = originalImage->width;
+    int original_image_height = originalImage->height;
+
+    /* 画像の外側の補い方 */
+    int border = getBorderMode();
+    /* tmpImageを作らずにフィルタを2回計算するかどうか */
+    int fused = getFusedMode();
+    /* 勾配の大きさを近似するかどうか */
+    stencil = getMagnitudeStencil(stencil);
+
+    /* 各要素の確認 */
+    printDiagnostic("original_image: width=%d, height=%d, maxValue=%d\n", original_image_width, original_image_height, originalImage->maxValue);
+    printDiagnostic("result_image_before: width=%d, height=%d, maxValue=%d\n", resultImage->width, resultImage->height, resultImage->maxValue);
+    printDiagnostic("stencil: isa=%s, threads=%d, border=%s, fused=%d\n", stencilIsaNames[getStencilIsa()], getThreadCount(), borderNames[border], fused);
+    printMagnitudeError(stencil);
+
+    if (fused)
+    {
+        /* フィルタリングと変換(tmpImageを作らずにresultImageにセット) */
+        stencilFusedImage(originalImage, resultImage, stencil, border, output);
+    }
+    else
+    {
+        /* 値がint16型のtmpImageの初期化 */
+        reuseInt16Image(tmpImage, original_image_width, original_image_height);
+        printDiagnostic("tmp_image: width=%d, height=%d\n", tmpImage->width, tmpImage->height);
+
+        /* フィルタリング(フィルタの値と最小値、最大値をtmpImageにセット) */
+        stencilImage(originalImage, tmpImage, stencil, border);
+
+        if (output == STENCIL_OUTPUT_NORMALIZE)
+        {
+            /* [0, 255]に正規化したものをresultImageにセット */
+            setNormalizedImageData(tmpImage, resultImage);
+        }
+        else
+        {
+            /* [0, 255]にクリッピングしたものをresultImageにセット */
+            setClampedImageData(tmpImage, resultImage);
+        }
+    }
+
+    /* 計算結果の確認 */
+    printDiagnostic("result_image_after: width=%d, height=%d, maxValue=%d\n", resultImage->width, resultImage->height, resultImage->maxValue);
+
+    return;
+}
+
+#endif /* STENCIL_H */
@@ -0,0 +1,362 @@
+/*
+ * 行単位のストリーミング処理
+ *
+ *   画像全体をメモリに置かずに、入力ファイルから1行ずつ読み込み、3行
+ * 分のリングバッファで 3x3 のフィルタを計算して、出来た行から出力ファ
+ * イルに書き込む。使うメモリは画像の幅に比例し、高さによらない。
+ *   正規化には画像全体の最小値と最大値が必要なので、1回目の走査で最小
+ * 値と最大値だけを求め、2回目の走査でもう一度フィルタを計算して正規化
+ * しながら書き込む。入力がシークできない時(パイプなど)は、1回目に読
+ * んだ画素値データを一時ファイルに書き出しておき、2回目はそこから読む。
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+#include "filter.h"
+#include "stencil.h"
+
+/*
+ * 入力ストリーム構造体の定義
+ */
+typedef struct
+{
+    FILE *fp;              /* 入力ファイル */
+    int width;             /* 画像の横方向の画素数 */
+    int height;            /* 画像の縦方向の画素数 */
+    int maxValue;          /* 画素の値(明るさ)の最大値 */
+    unsigned char *buffer; /* ヘッダと一緒に読み込んだ内容 */
+    size_t bufferLength;   /* buffer の大きさ */
+    size_t bufferPos;      /* buffer の中の次に読む画素値データの位置 */
+    long dataOffset;       /* 画素値データの先頭のファイル上の位置 */
+                           /* (シークできない時は -1) */
+    FILE *spill;           /* 2回目の走査のための画素値データの写し */
+    int replay;            /* spill から読んでいるかどうか */
+} pgm_stream_t;
+
+/*
+ * 3行分のリングバッファ構造体の定義
+ */
+typedef struct
+{
+    int width;             /* 画像の横方向の画素数 */
+    int height;            /* 画像の縦方向の画素数 */
+    int border;            /* 画像の外側の補い方 */
+    unsigned char *rows;   /* 3行分の領域と、0 の1行(各行は左右を */
+                           /* 1画素ずつ補って width+2 バイト) */
+    int loadedRows;        /* 読み込んだ行数 */
+} stencil_window_t;
+
+/*======================================================================
+ * ストリーミング処理を行うかどうかの取得
+ *======================================================================
+ *   環境変数 FILTER_STREAM が 0 以外の時に、ストリーミング処理を行う。
+ */
+int getStreamMode(void)
+{
+    const char *env = getenv("FILTER_STREAM");
+
+    return env != NULL && atoi(env) != 0;
+}
+
+/*======================================================================
+ * 入力ストリームの準備
+ *======================================================================
+ *   PGM-RAW フォーマットの画像データファイル FILE *fp のヘッダ部分を
+ * 読み込んで、pgm_stream_t *stream を初期化する。画素値データを passes
+ * 回読む場合で、入力がシークできない時は、一時ファイルを作っておく。
+ */
+void openPgmRawStream(FILE *fp, pgm_stream_t *stream, int passes)
+{
+    long start = ftell(fp);
+    size_t offset;
+
+    stream->fp = fp;
+    stream->buffer = readPgmRawHeaderChunks(fp, &stream->width, &stream->height, &stream->maxValue,
+                                            &offset, &stream->bufferLength);
+    stream->bufferPos = offset;
+    stream->dataOffset = start >= 0 ? start + (long)offset : -1;
+    stream->spill = NULL;
+    stream->replay = 0;
+
+    if (passes > 1 && stream->dataOffset < 0)
+    {
+        stream->spill = tmpfile();
+        if (stream->spill == NULL)
+        {
+            fputs("Creating a temporary file was failed\n", stderr);
+            exit(1);
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 入力ストリームからの1行の読み込み
+ *======================================================================
+ *   次の1行(width バイト)の画素値データを unsigned char *row に読み込
+ * む。一時ファイルがある時は、1回目の走査で読んだ行をそこにも書き出す。
+ */
+void readPgmRawRow(pgm_stream_t *stream, unsigned char *row)
+{
+    size_t width = (size_t)stream->width;
+
+    if (stream->replay)
+    {
+        if (fread(row, sizeof(unsigned char), width, stream->spill) != width)
+        {
+            goto error;
+        }
+        return;
+    }
+
+    /* ヘッダと一緒に読み込んだ分 */
+    size_t n = stream->bufferLength - stream->bufferPos;
+    if (n > width)
+    {
+        n = width;
+    }
+    memcpy(row, stream->buffer + stream->bufferPos, n);
+    stream->bufferPos += n;
+
+    /* 残りはファイルから */
+    if (fread(row + n, sizeof(unsigned char), width - n, stream->fp) != width - n)
+    {
+        goto error;
+    }
+
+    if (stream->spill != NULL && fwrite(row, sizeof(unsigned char), width, stream->spill) != width)
+    {
+        fputs("Writing a temporary file was failed\n", stderr);
+        exit(1);
+    }
+
+    return;
+
+error:
+    fputs("Reading PGM-RAW bitmap data was failed\n", stderr);
+    exit(1);
+}
+
+/*======================================================================
+ * 入力ストリームの巻き戻し
+ *======================================================================
+ *   2回目の走査のために、画素値データの先頭から読めるようにする。
+ */
+void rewindPgmRawStream(pgm_stream_t *stream)
+{
+    if (stream->spill != NULL)
+    {
+        rewind(stream->spill);
+        stream->replay = 1;
+        return;
+    }
+
+    if (fseek(stream->fp, stream->dataOffset, SEEK_SET) != 0)
+    {
+        fputs("Seeking the input file was failed\n", stderr);
+        exit(1);
+    }
+    stream->bufferPos = stream->bufferLength;
+
+    return;
+}
+
+/*======================================================================
+ * 入力ストリームの後始末
+ *======================================================================
+ */
+void closePgmRawStream(pgm_stream_t *stream)
+{
+    if (stream->spill != NULL)
+    {
+        fclose(stream->spill);
+    }
+    free(stream->buffer);
+
+    stream->spill = NULL;
+    stream->buffer = NULL;
+
+    return;
+}
+
+/*======================================================================
+ * リングバッファの初期化
+ *======================================================================
+ */
+void initStencilWindow(stencil_window_t *window, int width, int height, int border)
+{
+    window->width = width;
+    window->height = height;
+    window->border = border;
+    window->loadedRows = 0;
+
+    window->rows = (unsigned char *)malloc(sizeof(unsigned char) * 4 * ((size_t)width + 2));
+    if (window->rows == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+    memset(window->rows + 3 * ((size_t)width + 2), 0, (size_t)width + 2);
+
+    return;
+}
+
+/*======================================================================
+ * リングバッファを使った1行のステンシル演算
+ *======================================================================
+ *   y 行目の計算に必要な y+1 行目までを入力ストリームから読み込んでか
+ * ら、stencil の種類のフィルタの値を int16_t *out にセットし、最小値
+ * *minValue、最大値 *maxValue を更新する。y は 0 から順に与える。
+ *   行 i はリングバッファの i % 3 番目に置く。上下の外側の行は
+ * getBorderIndex() で画像の中の行に置き換える(BORDER_ZERO では 0 の
+ * 行を使う)。置き換えた行は y-1 行目から y+1 行目の範囲に入るので、
+ * リングバッファに残っている。
+ */
+void stencilWindowRow(stencil_window_t *window, pgm_stream_t *stream, int stencil, int y,
+                      int16_t *out, int *minValue, int *maxValue)
+{
+    int width = window->width;
+    int height = window->height;
+    int border = window->border;
+    size_t stride = (size_t)width + 2;
+    int last = y + 1 < height ? y + 1 : height - 1;
+    const unsigned char *rows[3];
+
+    /* y+1 行目までの読み込み */
+    while (window->loadedRows <= last)
+    {
+        unsigned char *row = window->rows + stride * (window->loadedRows % 3);
+        int left = getBorderIndex(-1, width, border);
+        int right = getBorderIndex(width, width, border);
+
+        readPgmRawRow(stream, row + 1);
+        row[0] = left < 0 ? 0 : row[left + 1];
+        row[width + 1] = right < 0 ? 0 : row[right + 1];
+        window->loadedRows++;
+    }
+
+    /* 近傍の3行 */
+    for (int j = 0; j < 3; j++)
+    {
+        int sy = getBorderIndex(y + j - 1, height, border);
+
+        rows[j] = window->rows + stride * (sy < 0 ? 3 : sy % 3) + 1;
+    }
+
+    stencilRow(getStencilIsa(), rows[0], rows[1], rows[2], out, 0, width, minValue, maxValue, stencil);
+
+    return;
+}
+
+/*======================================================================
+ * ストリーミング処理によるフィルタリング
+ *======================================================================
+ *   入力ファイル FILE *infp の画像に stencil の種類のフィルタをかけ、
+ * output の方法で [0, 255] の値にして、出力ファイル FILE *outfp に
+ * PGM-RAW フォーマットで書き込む。画像全体はメモリに置かず、行ごとに
+ * 読み込み、計算し、書き込む。
+ *   STENCIL_OUTPUT_NORMALIZE の時は、1回目の走査で最小値(初期値 255)と最大値
+ * (初期値 0)を求めてから、2回目の走査で書き込む。結果は画像全体をメ
+ * モリに置いて処理した時と同じになる。
+ */
+void streamFilteringImage(FILE *infp, FILE *outfp, int stencil, int output)
+{
+    pgm_stream_t stream;
+    stencil_window_t window;
+    image_t resultImage;
+    normalize_table_t table;
+    int minValue = 255;
+    int maxValue = 0;
+    int border = getBorderMode();
+    stage_timer_t timer;
+
+    /* 勾配の大きさを近似するかどうか */
+    stencil = getMagnitudeStencil(stencil);
+
+    openPgmRawStream(infp, &stream, output == STENCIL_OUTPUT_NORMALIZE ? 2 : 1);
+    initStencilWindow(&window, stream.width, stream.height, border);
+
+    int16_t *tmpRow = (int16_t *)malloc(sizeof(int16_t) * stream.width);
+    unsigned char *resultRow = (unsigned char *)malloc(sizeof(unsigned char) * stream.width);
+    if (tmpRow == NULL || resultRow == NULL)
+    {
+        fputs("out of memory\n", stderr);
+        exit(1);
+    }
+
+    /* 各要素の確認 */
+    printDiagnostic("original_image: width=%d, height=%d, maxValue=%d\n", stream.width, stream.height, stream.maxValue);
+    printDiagnostic("stream: source=%s, isa=%s, border=%s\n",
+           output != STENCIL_OUTPUT_NORMALIZE ? "single" : (stream.spill != NULL ? "spill" : "seek"),
+           stencilIsaNames[getStencilIsa()], borderNames[border]);
+    printMagnitudeError(stencil);
+
+    size_t pixels = (size_t)stream.width * stream.height;
+
+    /* 1回目の走査(最小値、最大値) */
+    if (output == STENCIL_OUTPUT_NORMALIZE)
+    {
+        beginStage(&timer);
+        for (int y = 0; y < stream.height; y++)
+        {
+            stencilWindowRow(&window, &stream, stencil, y, tmpRow, &minValue, &maxValue);
+        }
+        endStage(&timer, "stream_convolve", pixels, pixels);
+        printDiagnostic("tmp_image: minValue=%d, maxValue=%d\n", minValue, maxValue);
+        initNormalizeTable(&table, minValue, maxValue, stream.maxValue);
+
+        rewindPgmRawStream(&stream);
+        window.loadedRows = 0;
+    }
+
+    /* 画像ファイルのヘッダ部分の書き込み */
+    resultImage.width = stream.width;
+    resultImage.height = stream.height;
+    resultImage.maxValue = stream.maxValue;
+    writePgmRawHeader(outfp, &resultImage);
+
+    /* 1行ずつ計算して書き込む */
+    beginStage(&timer);
+    for (int y = 0; y < stream.height; y++)
+    {
+        int rowMinValue = 255;
+        int rowMaxValue = 0;
+
+        stencilWindowRow(&window, &stream, stencil, y, tmpRow, &rowMinValue, &rowMaxValue);
+        if (output == STENCIL_OUTPUT_NORMALIZE)
+        {
+            normalizeRow(tmpRow, resultRow, stream.width, &table);
+        }
+        else
+        {
+            clampRow(tmpRow, resultRow, stream.width);
+        }
+
+        if (fwrite(resultRow, sizeof(unsigned char), stream.width, outfp) != (size_t)stream.width)
+        {
+            fputs("Writing PGM-RAW bitmap data was failed\n", stderr);
+            exit(1);
+        }
+    }
+    endStage(&timer, output == STENCIL_OUTPUT_NORMALIZE ? "stream_normalize_write" : "stream_clamp_write",
+             pixels * 2, pixels);
+
+    if (output == STENCIL_OUTPUT_NORMALIZE)
+    {
+        freeNormalizeTable(&table);
+    }
+    free(tmpRow);
+    free(resultRow);
+    free(window.rows);
+    closePgmRawStream(&stream);
+
+    return;
+}
+
+#endif /* STREAM_H */
@@ -0,0 +1,137 @@
+/*
+ * 合成画像の作成
+ *
+ *   ベンチマーク(bench.c)と適合性の確認(conformance.c)の入力にする画
+ * 像を、ファイルを使わずに作る。乱数は環境によらない整数のハッシュな
+ * ので、同じ引数からはどこでも同じ画像ができる。
+ */
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgm.h"
+
+/*
+ * 合成画像の種類
+ */
+#define PATTERN_NOISE 0    /* 一様乱数 */
+#define PATTERN_GRADIENT 1 /* 斜めのグラデーション */
+#define PATTERN_TEXTURE 2  /* 自然画像に近い模様(数オクターブの補間ノイズ) */
+#define PATTERN_CONSTANT 3 /* 一定値 */
+
+static const char *patternNames[] = {"noise", "gradient", "texture", "constant"};
+#define PATTERN_COUNT ((int)(sizeof(patternNames) / sizeof(patternNames[0])))
+
+/*======================================================================
+ * 合成画像の乱数
+ *======================================================================
+ *   (x, y) と種 seed から決まる 0 から 255 までの値を返す。環境によら
+ * ず同じ画像になるように、rand() は使わない。
+ */
+int synthHash(unsigned x, unsigned y, unsigned seed)
+{
+    unsigned h = x * 0x8da6b343u ^ y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+
+    h ^= h >> 13;
+    h *= 0x85ebca6bu;
+    h ^= h >> 16;
+
+    return (int)(h & 0xff);
+}
+
+/*======================================================================
+ * 補間ノイズ
+ *======================================================================
+ *   cell 画素ごとの格子点に乱数を置き、その間を双線形補間した値を返す。
+ */
+double valueNoise(int x, int y, int cell, unsigned seed)
+{
+    int cx = x / cell;
+    int cy = y / cell;
+    double fx = (double)(x % cell) / cell;
+    double fy = (double)(y % cell) / cell;
+
+    double v00 = synthHash(cx, cy, seed);
+    double v10 = synthHash(cx + 1, cy, seed);
+    double v01 = synthHash(cx, cy + 1, seed);
+    double v11 = synthHash(cx + 1, cy + 1, seed);
+
+    double top = v00 + (v10 - v00) * fx;
+    double bottom = v01 + (v11 - v01) * fx;
+
+    return top + (bottom - top) * fy;
+}
+
+/*======================================================================
+ * 合成画像の作成
+ *======================================================================
+ *   pattern の種類の width × height、階調数 maxValue の画像を
+ * image_t *ptImage に作る。画素値は 0 から 255 までの値を maxValue に
+ * 合わせて縮めたもの。同じ引数からは、いつも同じ画像ができる。
+ */
+void generateImage(image_t *ptImage, int pattern, int width, int height, int maxValue, unsigned seed)
+{
+    initImage(ptImage, width, height, maxValue);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int value;
+
+            switch (pattern)
+            {
+            case PATTERN_NOISE:
+                value = synthHash(x, y, seed);
+                break;
+            case PATTERN_GRADIENT:
+                value = width + height > 2 ? (x + y) * 255 / (width + height - 2) : 0;
+                break;
+            case PATTERN_TEXTURE:
+            {
+                /* 大きな模様ほど振幅を大きくする(1/f に近い) */
+                double sum = valueNoise(x, y, 64, seed) * 0.5 +
+                             valueNoise(x, y, 16, seed + 1) * 0.25 +
+                             valueNoise(x, y, 4, seed + 2) * 0.15 +
+                             synthHash(x, y, seed + 3) * 0.1;
+                value = (int)sum;
+                break;
+            }
+            default:
+                value = 128;
+                break;
+            }
+
+            ptImage->data[x + ptImage->stride * y] = (unsigned char)(value * maxValue / 255);
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * 名前からの合成画像の種類の取得
+ *======================================================================
+ *   登録されていない時は -2 を、"all" の時は -1 を返す。
+ */
+int findPattern(const char *name)
+{
+    if (strcmp(name, "all") == 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < PATTERN_COUNT; i++)
+    {
+        if (strcmp(name, patternNames[i]) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -2;
+}
+
+#endif /* SYNTH_H */
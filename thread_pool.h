@@ -0,0 +1,250 @@
+/*
+ * スレッドプール
+ *
+ *   画像の行などの範囲 [0, n) を帯に分けて、あらかじめ起動しておいたス
+ * レッドで並列に処理する。スレッドは最初に並列処理を行う時に起動し、
+ * その後は終了せずに次の処理を待つ。
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+ * スレッド数の上限
+ */
+#define MAX_THREADS 256
+
+/*
+ * 帯ごとの処理を行う関数の型
+ *   arg は parallelFor() に渡したもの、band は帯の番号(0 から帯の数
+ * - 1)、[begin, end) はその帯が受け持つ範囲。
+ */
+typedef void (*parallel_task_t)(void *arg, int band, int begin, int end);
+
+/*
+ * スレッドプール構造体の定義
+ */
+typedef struct
+{
+    int threadCount;          /* 呼び出し元を含めたスレッド数 */
+    int started;              /* スレッドを起動したかどうか */
+    pthread_t threads[MAX_THREADS];
+    pthread_mutex_t mutex;    /* 以下の処理の状態を保護する */
+    pthread_cond_t start;     /* 処理の開始の通知 */
+    pthread_cond_t done;      /* 処理の終了の通知 */
+    pthread_mutex_t jobMutex; /* parallelFor() の呼び出しを1つずつにする */
+    unsigned long generation; /* 処理の通し番号 */
+    parallel_task_t task;     /* 処理を行う関数 */
+    void *arg;                /* 関数に渡す引数 */
+    int n;                    /* 範囲の大きさ */
+    int bands;                /* 帯の数 */
+    int nextBand;             /* 次に処理する帯 */
+    int remaining;            /* 処理が終わっていない帯の数 */
+} thread_pool_t;
+
+static thread_pool_t threadPool = {
+    0, 0, {0}, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, 0, 0, 0, 0};
+
+/*
+ * スレッドプールの処理の中で実行しているかどうか
+ */
+static __thread int inParallelTask = 0;
+
+/*======================================================================
+ * CPU のコア数の取得
+ *======================================================================
+ */
+int getCpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+/*======================================================================
+ * スレッド数の設定
+ *======================================================================
+ *   並列処理に使うスレッド数(呼び出し元を含む)を設定する。スレッドを
+ * 起動した後は変更できない。
+ */
+void setThreadCount(int threadCount)
+{
+    if (threadPool.started)
+    {
+        return;
+    }
+    if (threadCount < 1)
+    {
+        threadCount = 1;
+    }
+    if (threadCount > MAX_THREADS)
+    {
+        threadCount = MAX_THREADS;
+    }
+    threadPool.threadCount = threadCount;
+
+    return;
+}
+
+/*======================================================================
+ * スレッド数の取得
+ *======================================================================
+ *   並列処理に使うスレッド数を返す。setThreadCount() で設定していな
+ * い時は、環境変数 FILTER_THREADS の値、それもなければ CPU のコア数
+ * とする。
+ */
+int getThreadCount(void)
+{
+    if (threadPool.threadCount == 0)
+    {
+        const char *env = getenv("FILTER_THREADS");
+
+        setThreadCount(env != NULL ? atoi(env) : getCpuCount());
+    }
+
+    return threadPool.threadCount;
+}
+
+/*======================================================================
+ * 帯の処理
+ *======================================================================
+ *   まだ処理されていない帯を1つずつ取り出して処理する。threadPool.mutex
+ * をロックした状態で呼び出す。
+ */
+static void runParallelBands(void)
+{
+    while (threadPool.nextBand < threadPool.bands)
+    {
+        int band = threadPool.nextBand++;
+        parallel_task_t task = threadPool.task;
+        void *arg = threadPool.arg;
+        int begin = (int)((long long)threadPool.n * band / threadPool.bands);
+        int end = (int)((long long)threadPool.n * (band + 1) / threadPool.bands);
+
+        pthread_mutex_unlock(&threadPool.mutex);
+        inParallelTask = 1;
+        task(arg, band, begin, end);
+        inParallelTask = 0;
+        pthread_mutex_lock(&threadPool.mutex);
+
+        if (--threadPool.remaining == 0)
+        {
+            pthread_cond_signal(&threadPool.done);
+        }
+    }
+
+    return;
+}
+
+/*======================================================================
+ * スレッドプールのスレッド
+ *======================================================================
+ */
+static void *threadPoolWorker(void *unused)
+{
+    unsigned long generation = 0;
+
+    (void)unused;
+
+    pthread_mutex_lock(&threadPool.mutex);
+    for (;;)
+    {
+        /* 新しい処理を待つ */
+        while (threadPool.generation == generation)
+        {
+            pthread_cond_wait(&threadPool.start, &threadPool.mutex);
+        }
+        generation = threadPool.generation;
+
+        runParallelBands();
+    }
+
+    return NULL;
+}
+
+/*======================================================================
+ * 並列処理
+ *======================================================================
+ *   範囲 [0, n) を、スレッド数(n の方が小さければ n)個の連続した帯に
+ * 分け、各帯について task(arg, band, begin, end) を並列に呼び出して、
+ * すべて終わるまで待つ。呼び出し元のスレッドも帯を処理する。使った帯
+ * の数(MAX_THREADS 以下)を返す。
+ *   スレッドプールの処理の中から呼ばれた時は、範囲全体を1つの帯として
+ * そのまま処理する。
+ */
+int parallelFor(int n, parallel_task_t task, void *arg)
+{
+    int bands = getThreadCount();
+
+    if (bands > n)
+    {
+        bands = n;
+    }
+    if (bands <= 1 || inParallelTask)
+    {
+        if (n > 0)
+        {
+            task(arg, 0, 0, n);
+        }
+        return 1;
+    }
+
+    pthread_mutex_lock(&threadPool.jobMutex);
+
+    /* スレッドの起動 */
+    if (!threadPool.started)
+    {
+        for (int i = 1; i < threadPool.threadCount; i++)
+        {
+            if (pthread_create(&threadPool.threads[i], NULL, threadPoolWorker, NULL) != 0)
+            {
+                fputs("Creating a thread was failed\n", stderr);
+                exit(1);
+            }
+        }
+        threadPool.started = 1;
+    }
+
+    /* 処理の開始 */
+    pthread_mutex_lock(&threadPool.mutex);
+    threadPool.task = task;
+    threadPool.arg = arg;
+    threadPool.n = n;
+    threadPool.bands = bands;
+    threadPool.nextBand = 0;
+    threadPool.remaining = bands;
+    threadPool.generation++;
+    pthread_cond_broadcast(&threadPool.start);
+
+    /* 呼び出し元も帯を処理し、すべて終わるまで待つ */
+    runParallelBands();
+    while (threadPool.remaining > 0)
+    {
+        pthread_cond_wait(&threadPool.done, &threadPool.mutex);
+    }
+    pthread_mutex_unlock(&threadPool.mutex);
+
+    pthread_mutex_unlock(&threadPool.jobMutex);
+
+    return bands;
+}
+
+#endif /* THREAD_POOL_H */